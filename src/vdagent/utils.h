@@ -44,8 +44,10 @@ input_stream_read_all_finish (GInputStream *stream,
                               gsize        *bytes_read,
                               GError      **error);
 
-gchar* str_from_data(char *data, gsize len, gssize *pos);
-GStrv strv_from_data(char *data, gsize len, gssize *pos);
+/* Return the NUL terminated string at the start of the len bytes of data,
+   which is not copied, and set pos to the offset following it. Returns NULL
+   if there is no NUL in data */
+const gchar* str_from_data(const gchar *data, gsize len, gssize *pos);
 
 G_END_DECLS
 
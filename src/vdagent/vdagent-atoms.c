@@ -0,0 +1,127 @@
+/*
+ * vdagent session
+ * Copyright (C) 2026  The spice-vdagent contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "vdagent-atoms.h"
+
+typedef struct _Entry {
+    gchar *name;
+    GdkAtom atom;
+    /* 0 until the id is asked for */
+    guint id;
+} Entry;
+
+static GHashTable *by_name;
+static GHashTable *by_atom;
+/* entries by id - 1 */
+static GPtrArray *by_id;
+
+static Entry*
+add_entry(const gchar *name, GdkAtom atom)
+{
+    Entry *entry = g_slice_new(Entry);
+
+    if (by_id == NULL) {
+        by_name = g_hash_table_new(g_str_hash, g_str_equal);
+        by_atom = g_hash_table_new(g_direct_hash, g_direct_equal);
+        by_id = g_ptr_array_new();
+    }
+
+    entry->name = g_strdup(name);
+    entry->atom = atom;
+    entry->id = 0;
+
+    g_hash_table_insert(by_name, entry->name, entry);
+    g_hash_table_insert(by_atom, atom, entry);
+
+    return entry;
+}
+
+/* Every name gets interned as an atom, GDK keeps those forever anyway, so
+   the cache never holds a name GDK does not hold already */
+static Entry*
+lookup_name(const gchar *name)
+{
+    Entry *entry = by_name ? g_hash_table_lookup(by_name, name) : NULL;
+
+    if (entry == NULL)
+        entry = add_entry(name, gdk_atom_intern(name, FALSE));
+
+    return entry;
+}
+
+const gchar*
+vdagent_atoms_intern(const gchar *name)
+{
+    g_return_val_if_fail(name != NULL, NULL);
+
+    return lookup_name(name)->name;
+}
+
+GdkAtom
+vdagent_atoms_get(const gchar *name)
+{
+    g_return_val_if_fail(name != NULL, GDK_NONE);
+
+    return lookup_name(name)->atom;
+}
+
+const gchar*
+vdagent_atoms_name(GdkAtom atom)
+{
+    Entry *entry;
+    gchar *name;
+
+    g_return_val_if_fail(atom != GDK_NONE, NULL);
+
+    entry = by_atom ? g_hash_table_lookup(by_atom, atom) : NULL;
+    if (entry)
+        return entry->name;
+
+    name = gdk_atom_name(atom);
+    entry = add_entry(name, atom);
+    g_free(name);
+
+    return entry->name;
+}
+
+guint
+vdagent_atoms_id(const gchar *name)
+{
+    Entry *entry;
+
+    g_return_val_if_fail(name != NULL, 0);
+
+    /* only names which get sent use up ids */
+    entry = lookup_name(name);
+    if (entry->id == 0) {
+        g_ptr_array_add(by_id, entry);
+        entry->id = by_id->len;
+    }
+
+    return entry->id;
+}
+
+const gchar*
+vdagent_atoms_id_name(guint id)
+{
+    if (by_id == NULL || id == 0 || id > by_id->len)
+        return NULL;
+
+    return ((Entry *)g_ptr_array_index(by_id, id - 1))->name;
+}
@@ -0,0 +1,42 @@
+/*
+ * vdagent session
+ * Copyright (C) 2026  The spice-vdagent contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef VDAGENT_ATOMS_H_
+#define VDAGENT_ATOMS_H_
+
+#include <gtk/gtk.h>
+
+G_BEGIN_DECLS
+
+/* Process wide cache of target names and their atoms, filled as names and
+ * atoms are looked up, and of small ids (starting at 1), given out as they
+ * are asked for. The returned names are owned by the cache and stay valid
+ * forever, like the atoms GDK interns, so the same name is always returned
+ * as the same pointer and can be compared with ==. */
+
+const gchar* vdagent_atoms_intern       (const gchar *name);
+GdkAtom      vdagent_atoms_get          (const gchar *name);
+const gchar* vdagent_atoms_name         (GdkAtom atom);
+guint        vdagent_atoms_id           (const gchar *name);
+/* returns NULL for unknown ids */
+const gchar* vdagent_atoms_id_name      (guint id);
+
+G_END_DECLS
+
+#endif
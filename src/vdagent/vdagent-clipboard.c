@@ -17,9 +17,25 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#include <stdlib.h>
 #include <string.h>
 
 #include "vdagent-clipboard.h"
+#include "vdagent-atoms.h"
+#include "vdagent-text.h"
+
+/* Time to wait for more owner changes before sending a grab, in ms */
+#define OWNER_CHANGE_DELAY 100
+
+/* info of the STRING target added for clients only offering UTF8_STRING */
+#define TARGET_INFO_LATIN1 G_MAXUINT
+
+static gboolean
+is_utf8_target(const gchar *name)
+{
+    return !strcmp(name, "UTF8_STRING") ||
+        !g_ascii_strcasecmp(name, "text/plain;charset=utf-8");
+}
 
 static GtkClipboard*
 clipboard_get(GdkAtom selection)
@@ -42,27 +58,59 @@ selection_atom(guint8 selection)
     if (selection == VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD)
         return GDK_SELECTION_CLIPBOARD;
     if (selection == VD_AGENT_CLIPBOARD_SELECTION_DND)
-        return gdk_atom_intern("XdndSelection", FALSE);
+        return vdagent_atoms_get("XdndSelection");
 
     g_return_val_if_reached(GDK_NONE);
 }
 
-static guint8
-get_selection_from_clipboard(GtkClipboard* cb)
+/* Returns -1 for selections we don't handle */
+static gint
+selection_from_atom(GdkAtom selection)
 {
-    GdkAtom selection;
-
-    selection = g_object_get_data(G_OBJECT(cb), "selection");
     if (selection == GDK_SELECTION_PRIMARY)
         return VD_AGENT_CLIPBOARD_SELECTION_PRIMARY;
     if (selection == GDK_SELECTION_SECONDARY)
         return VD_AGENT_CLIPBOARD_SELECTION_SECONDARY;
     if (selection == GDK_SELECTION_CLIPBOARD)
         return VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD;
-    if (selection == gdk_atom_intern("XdndSelection", FALSE))
+    if (selection == vdagent_atoms_get("XdndSelection"))
         return VD_AGENT_CLIPBOARD_SELECTION_DND;
 
-    g_return_val_if_reached(0);
+    return -1;
+}
+
+static guint8
+get_selection_from_clipboard(GtkClipboard* cb)
+{
+    gint selection;
+
+    selection = selection_from_atom(g_object_get_data(G_OBJECT(cb), "selection"));
+    g_return_val_if_fail(selection >= 0, 0);
+
+    return selection;
+}
+
+/* Return the id of type, which must come from the atoms cache, for messages
+   to vdagentd, announcing it first if it has not been used yet. Returns 0 if
+   it can't have an id. */
+static guint16
+type_id(SpiceVDAgent *agent, const gchar *type)
+{
+    guint id = vdagent_atoms_id(type);
+
+    if (id > G_MAXUINT16) {
+        g_warning("out of clipboard type ids, dropping %s", type);
+        return 0;
+    }
+
+    if (!g_hash_table_lookup(agent->clipboard_types_sent, GUINT_TO_POINTER(id))) {
+        g_hash_table_insert(agent->clipboard_types_sent, GUINT_TO_POINTER(id),
+                            GUINT_TO_POINTER(TRUE));
+        spice_vdagent_write_msg(agent, VDAGENTD_CLIPBOARD_TYPE, id, 0,
+                                (gpointer)type, strlen(type) + 1, NULL);
+    }
+
+    return id;
 }
 
 typedef struct _WeakRef {
@@ -92,42 +140,102 @@ static void weak_unref(WeakRef* weakref)
     g_free(weakref);
 }
 
+typedef struct _Request {
+    WeakRef *weakref;
+    guint generation;
+    /* STRING was asked in place of UTF8_STRING */
+    gboolean latin1;
+} Request;
+
 static void
 received_cb(GtkClipboard *clipboard,
             GtkSelectionData *selection_data,
             gpointer user_data)
 {
-    WeakRef *weakref = user_data;
-    SpiceVDAgent *agent = SPICE_VDAGENT(weakref->object);
-    weak_unref(weakref);
+    Request *request = user_data;
+    SpiceVDAgent *agent = SPICE_VDAGENT(request->weakref->object);
+    guint generation = request->generation;
+    gboolean latin1 = request->latin1;
+    weak_unref(request->weakref);
+    g_slice_free(Request, request);
 
     if (agent == NULL)
         return;
 
     gint len = 0;
+    gsize size;
     guint8 selection;
-    int max_clipboard = -1;
+    guint16 id;
 
     selection = get_selection_from_clipboard(clipboard);
 
-    /* FIXME: get max_clipboard from agentd */
-    len = gtk_selection_data_get_length(selection_data);
-    if (len == 0 || (max_clipboard != -1 && len > max_clipboard)) {
-        g_warning("discarded clipboard of size %d (max: %d)", len, max_clipboard);
+    if (generation != agent->clipboard_generation[selection]) {
+        g_debug("owner changed during clipboard request, cancelled");
+        spice_vdagent_write_header(agent, VDAGENTD_CLIPBOARD_DATA, selection, 0, 0);
         return;
-    } else if (len == -1) {
+    }
+
+    len = gtk_selection_data_get_length(selection_data);
+    if (len <= 0) {
         g_debug("empty clipboard");
-        len = 0;
+        spice_vdagent_write_header(agent, VDAGENTD_CLIPBOARD_DATA, selection, 0, 0);
+        return;
+    }
+
+    const guint8 *raw = gtk_selection_data_get_data(selection_data);
+    const gchar *target =
+        vdagent_atoms_name(gtk_selection_data_get_target(selection_data));
+    gchar *data;
+
+    /* answer UTF8_STRING with the converted STRING, and only replace the
+       invalid bytes of a broken UTF8_STRING, whatever its encoding is */
+    if (latin1) {
+        gsize out_len;
+
+        g_debug("converting Latin-1 clipboard text");
+        data = (gchar *)vdagent_text_convert(raw, len, VDAGENT_TEXT_LATIN1,
+                                             VDAGENT_TEXT_UTF8,
+                                             VDAGENT_TEXT_LINEEND_KEEP, &out_len);
+        len = out_len;
+        target = vdagent_atoms_intern("UTF8_STRING");
+    } else if (is_utf8_target(target) && !vdagent_text_validate_utf8(raw, len)) {
+        gsize out_len;
+
+        g_debug("replacing invalid UTF-8 in clipboard text");
+        data = (gchar *)vdagent_text_repair_utf8(raw, len, &out_len);
+        len = out_len;
     } else {
+        data = NULL;
     }
 
-    gchar *target = gdk_atom_name(gtk_selection_data_get_target(selection_data));
-    gchar *data = g_malloc(len);
-    memcpy(data, gtk_selection_data_get_data(selection_data), len);
+    size = len + sizeof(id);
+
+    /* check before copying, the daemon would discard it anyway, it counts
+       the type name the client gets in place of the id */
+    if (agent->max_clipboard != -1 &&
+        VDAGENTD_CLIPBOARD_DATA_SIZE(strlen(target), len) > agent->max_clipboard) {
+        g_warning("discarded clipboard of size %d (max: %d)",
+                  (gint)VDAGENTD_CLIPBOARD_DATA_SIZE(strlen(target), len),
+                  agent->max_clipboard);
+        g_free(data);
+        spice_vdagent_write_header(agent, VDAGENTD_CLIPBOARD_DATA, selection, 0, 0);
+        return;
+    }
+
+    id = type_id(agent, target);
+    if (id == 0) {
+        g_free(data);
+        spice_vdagent_write_header(agent, VDAGENTD_CLIPBOARD_DATA, selection, 0, 0);
+        return;
+    }
+
+    if (data == NULL) {
+        data = g_malloc(len);
+        memcpy(data, raw, len);
+    }
 
-    spice_vdagent_write_header(agent, VDAGENTD_CLIPBOARD_DATA, selection, 0,
-                               len + strlen(target) + 1);
-    spice_vdagent_write(agent, target, strlen(target) + 1, g_free);
+    spice_vdagent_write_header(agent, VDAGENTD_CLIPBOARD_DATA, selection, 0, size);
+    spice_vdagent_write(agent, &id, sizeof(id), NULL);
 
     spice_vdagent_write(agent, data, len, g_free);
 }
@@ -144,7 +252,7 @@ vdagent_clipboard_request(SpiceVDAgent *agent, guint8 selection,
     g_return_if_fail(SPICE_IS_VDAGENT(agent));
 
     selat = selection_atom(selection);
-    target = gdk_atom_intern(type, FALSE);
+    target = type ? vdagent_atoms_get(type) : GDK_NONE;
     if (selat == GDK_NONE || target == GDK_NONE) {
         g_debug("unknown selection:%d or target:%s", selection, type);
         goto none;
@@ -157,14 +265,318 @@ vdagent_clipboard_request(SpiceVDAgent *agent, guint8 selection,
 
     clipboard = clipboard_get(selat);
 
-    gtk_clipboard_request_contents(clipboard, target,
-                                   received_cb, weak_ref(G_OBJECT(agent)));
+    Request *request = g_slice_new(Request);
+    request->weakref = weak_ref(G_OBJECT(agent));
+    request->generation = agent->clipboard_generation[selection];
+    request->latin1 = is_utf8_target(type) && agent->clipboard_latin1[selection];
+    if (request->latin1)
+        target = gdk_atom_intern_static_string("STRING");
+    gtk_clipboard_request_contents(clipboard, target, received_cb, request);
     return;
 
 none:
     spice_vdagent_write_header(agent, VDAGENTD_CLIPBOARD_DATA, selection, 0, 0);
 }
 
+/* Client data for a target, kept until the client grabs or releases the
+   selection again, or it gets evicted */
+typedef struct _CacheEntry {
+    const gchar *type;
+    guint8 *data;
+    gsize size;
+    /* held by the cache and by the requests answered with it */
+    guint refs;
+    /* where it is cached, its link in the LRU queue is NULL once evicted */
+    guint8 selection;
+    const gchar *target;
+    GList *lru;
+} CacheEntry;
+
+/* Don't keep more than this per selection and target */
+#define CACHE_ENTRY_MAX_SIZE (64 * 1024 * 1024)
+/* nor more than this in total, the least recently used entries are evicted
+   to make room */
+#define CACHE_MAX_SIZE (128 * 1024 * 1024)
+
+static CacheEntry*
+cache_entry_ref(CacheEntry *entry)
+{
+    entry->refs++;
+    return entry;
+}
+
+static void
+cache_entry_unref(CacheEntry *entry)
+{
+    if (--entry->refs)
+        return;
+
+    g_free(entry->data);
+    g_slice_free(CacheEntry, entry);
+}
+
+static void
+cache_remove(SpiceVDAgent *agent, CacheEntry *entry)
+{
+    g_hash_table_remove(agent->clipboard_cache[entry->selection],
+                        entry->target);
+    g_queue_delete_link(&agent->clipboard_cache_lru, entry->lru);
+    entry->lru = NULL;
+    agent->clipboard_cache_size -= entry->size;
+    cache_entry_unref(entry);
+}
+
+static CacheEntry*
+cache_lookup(SpiceVDAgent *agent, guint8 selection, const gchar *target)
+{
+    CacheEntry *entry = NULL;
+
+    if (agent->clipboard_cache[selection])
+        entry = g_hash_table_lookup(agent->clipboard_cache[selection], target);
+
+    if (entry) {
+        /* it is the most recently used one now */
+        g_queue_unlink(&agent->clipboard_cache_lru, entry->lru);
+        g_queue_push_tail_link(&agent->clipboard_cache_lru, entry->lru);
+    }
+
+    return entry;
+}
+
+static void
+cache_add(SpiceVDAgent *agent, guint8 selection, const gchar *target,
+          CacheEntry *entry)
+{
+    CacheEntry *old;
+
+    if (entry->size > CACHE_ENTRY_MAX_SIZE)
+        return;
+
+    old = cache_lookup(agent, selection, target);
+    if (old)
+        cache_remove(agent, old);
+
+    while (agent->clipboard_cache_size + entry->size > CACHE_MAX_SIZE &&
+           !g_queue_is_empty(&agent->clipboard_cache_lru)) {
+        old = g_queue_peek_head(&agent->clipboard_cache_lru);
+        g_debug("evicting cached clipboard %s", old->target);
+        cache_remove(agent, old);
+    }
+
+    if (agent->clipboard_cache[selection] == NULL)
+        agent->clipboard_cache[selection] =
+            g_hash_table_new(g_direct_hash, g_direct_equal);
+    entry->selection = selection;
+    entry->target = target;
+    g_hash_table_insert(agent->clipboard_cache[selection], (gpointer)target,
+                        cache_entry_ref(entry));
+    g_queue_push_tail(&agent->clipboard_cache_lru, entry);
+    entry->lru = g_queue_peek_tail_link(&agent->clipboard_cache_lru);
+    agent->clipboard_cache_size += entry->size;
+}
+
+/* Remove the entries of selection, all if selection is -1 */
+static void
+cache_clear(SpiceVDAgent *agent, gint selection)
+{
+    GList *l, *next;
+
+    for (l = agent->clipboard_cache_lru.head; l; l = next) {
+        CacheEntry *entry = l->data;
+        next = l->next;
+        if (selection == -1 || entry->selection == selection)
+            cache_remove(agent, entry);
+    }
+}
+
+/* A request from a guest app for client data. GTK wants the data before its
+   get callback returns, so the X request is held back from GTK until the
+   client answered it, and then sent to us again for GTK to handle. */
+typedef struct _ClipboardGet {
+    /* id of the request sent to vdagentd, 0 once answered */
+    guint32 id;
+    guint8 selection;
+    /* the target asked from the client, from the atoms cache */
+    const gchar *target;
+    /* the SelectionRequest of the guest app */
+    XEvent event;
+    /* the answer of the client, NULL if it had no data */
+    CacheEntry *answer;
+} ClipboardGet;
+
+static void
+clipboard_get_free(ClipboardGet *get)
+{
+    if (get->answer)
+        cache_entry_unref(get->answer);
+    g_slice_free(ClipboardGet, get);
+}
+
+/* The window may be gone already */
+static void
+send_x_event(Window window, XEvent *event)
+{
+    GdkDisplay *display = gdk_display_get_default();
+
+    gdk_x11_display_error_trap_push(display);
+    XSendEvent(GDK_DISPLAY_XDISPLAY(display), window, False, NoEventMask,
+               event);
+    gdk_x11_display_error_trap_pop_ignored(display);
+}
+
+/* Tell the guest app there is no data for its request */
+static void
+clipboard_get_refuse(ClipboardGet *get)
+{
+    XSelectionRequestEvent *req = &get->event.xselectionrequest;
+    XEvent notify;
+
+    memset(&notify, 0, sizeof(notify));
+    notify.xselection.type = SelectionNotify;
+    notify.xselection.requestor = req->requestor;
+    notify.xselection.selection = req->selection;
+    notify.xselection.target = req->target;
+    notify.xselection.property = None;
+    notify.xselection.time = req->time;
+    send_x_event(req->requestor, &notify);
+}
+
+static gboolean
+same_request(const XSelectionRequestEvent *a, const XSelectionRequestEvent *b)
+{
+    return a->owner == b->owner && a->requestor == b->requestor &&
+        a->selection == b->selection && a->target == b->target &&
+        a->property == b->property && a->time == b->time;
+}
+
+/* Return the target to ask the client for when a guest app asks for xtarget,
+   NULL if the client does not offer it */
+static const gchar*
+client_target(SpiceVDAgent *agent, guint8 selection, Atom xtarget)
+{
+    const gchar **targets = agent->clipboard_client_targets[selection];
+    GdkAtom target;
+    int i;
+
+    if (targets == NULL)
+        return NULL;
+
+    target = gdk_x11_xatom_to_atom_for_display(gdk_display_get_default(),
+                                               xtarget);
+    for (i = 0; targets[i]; i++) {
+        if (vdagent_atoms_get(targets[i]) == target)
+            return targets[i];
+    }
+
+    /* STRING is converted from UTF8_STRING for clients not offering it */
+    if (target == gdk_atom_intern_static_string("STRING"))
+        return client_target(agent, selection,
+                             gdk_x11_get_xatom_by_name("UTF8_STRING"));
+
+    return NULL;
+}
+
+/* Requests for client data which is not cached are only passed on to GTK
+   once the client answered them. Requests for several targets at once
+   (MULTIPLE) are passed on right away, and only get cached data. */
+static GdkFilterReturn
+selection_request_filter(GdkXEvent *xevent, GdkEvent *event,
+                         gpointer user_data)
+{
+    SpiceVDAgent *agent = user_data;
+    XSelectionRequestEvent *req = &((XEvent *)xevent)->xselectionrequest;
+    ClipboardGet *get;
+    const gchar *target;
+    gint selection;
+    guint16 type;
+    GList *l;
+
+    if (((XEvent *)xevent)->type != SelectionRequest)
+        return GDK_FILTER_CONTINUE;
+
+    selection = selection_from_atom(
+        gdk_x11_xatom_to_atom_for_display(gdk_display_get_default(),
+                                          req->selection));
+    if (selection < 0 || agent->clipboard_owner[selection] != OWNER_CLIENT)
+        return GDK_FILTER_CONTINUE;
+
+    /* an answered request, sent to us again */
+    for (l = agent->clipboard_gets; l; l = l->next) {
+        get = l->data;
+        if (get->id == 0 && same_request(&get->event.xselectionrequest, req))
+            return GDK_FILTER_CONTINUE;
+    }
+
+    target = client_target(agent, selection, req->target);
+    if (target == NULL)
+        return GDK_FILTER_CONTINUE;
+    if (cache_lookup(agent, selection, target))
+        return GDK_FILTER_CONTINUE;
+
+    get = g_slice_new0(ClipboardGet);
+    get->selection = selection;
+    get->target = target;
+    get->event = *(XEvent *)xevent;
+
+    /* join a request for the same data which is on its way already */
+    for (l = agent->clipboard_gets; l; l = l->next) {
+        ClipboardGet *g = l->data;
+        if (g->id && g->selection == selection && g->target == target) {
+            get->id = g->id;
+            break;
+        }
+    }
+
+    if (get->id == 0) {
+        type = type_id(agent, target);
+        if (type == 0) {
+            /* GTK refuses it, having no data */
+            clipboard_get_free(get);
+            return GDK_FILTER_CONTINUE;
+        }
+        if (++agent->clipboard_get_id == 0) /* 0 means no id */
+            agent->clipboard_get_id++;
+        get->id = agent->clipboard_get_id;
+        spice_vdagent_write_msg(agent, VDAGENTD_CLIPBOARD_REQUEST,
+                                selection, get->id, &type, sizeof(type), NULL);
+    }
+    g_debug("clipboard get %u", get->id);
+
+    agent->clipboard_gets = g_list_append(agent->clipboard_gets, get);
+
+    return GDK_FILTER_REMOVE;
+}
+
+static void
+clipboard_get_set_data(GtkSelectionData *selection_data, gboolean latin1,
+                       const gchar *type, gconstpointer data, gsize size)
+{
+    GdkAtom target;
+
+    target = vdagent_atoms_get(type);
+    if (latin1)
+        target = gdk_atom_intern_static_string("STRING");
+
+    if (is_utf8_target(type)) {
+        VDAgentTextEncoding to = latin1 ? VDAGENT_TEXT_LATIN1 :
+                                          VDAGENT_TEXT_UTF8;
+        guint8 *text;
+        gsize len;
+
+        /* the guest advertises LF lineends, but not every client converts */
+        text = vdagent_text_convert(data, size, VDAGENT_TEXT_UTF8, to,
+                                    VDAGENT_TEXT_LINEEND_LF, &len);
+        if (text) {
+            gtk_selection_data_set(selection_data, target, 8, text, len);
+            g_free(text);
+            return;
+        }
+        g_debug("invalid UTF-8 clipboard text from client, passed on as is");
+    }
+
+    gtk_selection_data_set(selection_data, target, 8, data, size);
+}
+
 static void
 clipboard_get_cb(GtkClipboard *clipboard,
                  GtkSelectionData *selection_data,
@@ -172,48 +584,144 @@ clipboard_get_cb(GtkClipboard *clipboard,
 {
     SpiceVDAgent *agent = user_data;
     guint8 selection = get_selection_from_clipboard(clipboard);
+    gboolean latin1 = info == TARGET_INFO_LATIN1;
+    ClipboardGet *get = NULL;
+    CacheEntry *entry = NULL;
+    const gchar *target;
+    GList *l;
+
+    if (latin1)
+        target = vdagent_atoms_intern("UTF8_STRING");
+    else
+        target = vdagent_atoms_name(gtk_selection_data_get_target(selection_data));
+
+    /* answered requests all have the same data for a target, so it does not
+       matter which request this is */
+    for (l = agent->clipboard_gets; l; l = l->next) {
+        ClipboardGet *g = l->data;
+        if (g->id == 0 && g->selection == selection && g->target == target) {
+            get = g;
+            break;
+        }
+    }
 
-    g_debug("clipboard get");
-    g_return_if_fail(agent->clipboard_get.loop == NULL);
-
-    gchar *target = gdk_atom_name(gtk_selection_data_get_target(selection_data));
-    spice_vdagent_write_msg(agent, VDAGENTD_CLIPBOARD_REQUEST,
-                            selection, 0, target, strlen(target) + 1, g_free);
-
-    agent->clipboard_get.selection_data = selection_data;
-    agent->clipboard_get.loop = g_main_loop_new(NULL, FALSE);
-    agent->clipboard_get.selection = selection;
+    if (get) {
+        agent->clipboard_gets = g_list_remove(agent->clipboard_gets, get);
+        entry = get->answer;
+    } else {
+        entry = cache_lookup(agent, selection, target);
+        if (entry)
+            g_debug("clipboard get %s from cache", target);
+    }
 
-    g_main_loop_run(agent->clipboard_get.loop);
+    if (entry)
+        clipboard_get_set_data(selection_data, latin1, entry->type,
+                               entry->data, entry->size);
+    else
+        g_debug("no clipboard data for %s", target);
 
-    g_main_loop_unref(agent->clipboard_get.loop);
-    agent->clipboard_get.loop = NULL;
+    if (get)
+        clipboard_get_free(get);
 }
 
 void
-vdagent_clipboard_data(SpiceVDAgent *agent, guint8 selection,
+vdagent_clipboard_data(SpiceVDAgent *agent, guint8 selection, guint32 id,
                        const gchar *type,
                        gpointer data, gsize size)
 {
+    CacheEntry *entry = NULL;
+    const gchar *target = NULL;
+    GList *l;
+
     g_return_if_fail(SPICE_IS_VDAGENT(agent));
-    g_return_if_fail(agent->clipboard_get.loop != NULL);
 
-    g_debug("client clipboard data");
+    g_debug("client clipboard data %u", id);
+
+    if (type && size) {
+        entry = g_slice_new(CacheEntry);
+        entry->type = vdagent_atoms_intern(type);
+        entry->data = g_memdup(data, size);
+        entry->size = size;
+        entry->refs = 1;
+    }
 
-    gtk_selection_data_set(agent->clipboard_get.selection_data,
-                           gdk_atom_intern(type, FALSE),
-                           8, data, size);
+    /* answer all the requests which joined this one, and have GTK handle
+       them */
+    for (l = agent->clipboard_gets; l; l = l->next) {
+        ClipboardGet *get = l->data;
+        if (get->id != id || get->selection != selection)
+            continue;
 
-    g_main_loop_quit(agent->clipboard_get.loop);
+        get->id = 0;
+        get->answer = entry ? cache_entry_ref(entry) : NULL;
+        send_x_event(get->event.xselectionrequest.owner, &get->event);
+        target = get->target;
+    }
+
+    if (target == NULL)
+        g_debug("discarding data of a cancelled request");
+    else if (entry)
+        cache_add(agent, selection, target, entry);
+
+    if (entry)
+        cache_entry_unref(entry);
+}
+
+static gint
+compare_strings(gconstpointer a, gconstpointer b)
+{
+    return strcmp(*(const gchar **)a, *(const gchar **)b);
+}
+
+/* Forget the targets of the last grab sent for selection */
+static void
+forget_targets(SpiceVDAgent *self, guint8 selection)
+{
+    g_free(self->clipboard_targets[selection]);
+    self->clipboard_targets[selection] = NULL;
+}
+
+/* Abort the transfers in progress for selection, after its owner changed:
+   pending guest data is answered with an empty message instead, and the
+   guest apps waiting for client data are told there is none. */
+static void
+cancel_transfers(SpiceVDAgent *agent, guint8 selection)
+{
+    GList *l, *next;
+    guint n;
+
+    agent->clipboard_generation[selection]++;
+    cache_clear(agent, selection);
+
+    n = spice_vdagent_drop_pending(agent, VDAGENTD_CLIPBOARD_DATA, selection);
+    while (n--)
+        spice_vdagent_write_header(agent, VDAGENTD_CLIPBOARD_DATA, selection, 0, 0);
+
+    for (l = agent->clipboard_gets; l; l = next) {
+        ClipboardGet *get = l->data;
+        next = l->next;
+        if (get->selection != selection)
+            continue;
+
+        /* answered ones are on their way to GTK, which handles them */
+        if (get->id) {
+            g_debug("clipboard owner changed, cancelling client request %u",
+                    get->id);
+            clipboard_get_refuse(get);
+        }
+        agent->clipboard_gets = g_list_delete_link(agent->clipboard_gets, l);
+        clipboard_get_free(get);
+    }
 }
 
 void
 vdagent_clipboard_grab(SpiceVDAgent *agent, guint8 selection,
-                       const GStrv types)
+                       const gchar **types)
 {
     GtkTargetEntry *targets;
     GtkClipboard* clipboard;
     GdkAtom selat;
+    gboolean has_utf8 = FALSE, has_string = FALSE;
     int n, i, j;
 
     g_debug("client clipboard grab");
@@ -233,14 +741,34 @@ vdagent_clipboard_grab(SpiceVDAgent *agent, guint8 selection,
     clipboard = clipboard_get(selat);
     g_return_if_fail(clipboard != NULL);
 
-    n = g_strv_length(types);
-    targets = g_new0(GtkTargetEntry, n);
+    cancel_transfers(agent, selection);
+    if (agent->clipboard_owner_change[selection]) {
+        g_source_remove(agent->clipboard_owner_change[selection]);
+        agent->clipboard_owner_change[selection] = 0;
+    }
+    forget_targets(agent, selection);
+
+    for (n = 0; types[n]; n++)
+        ;
+    targets = g_new0(GtkTargetEntry, n + 1);
+    g_free(agent->clipboard_client_targets[selection]);
+    agent->clipboard_client_targets[selection] = g_new0(const gchar *, n + 1);
     for (i = 0, j = 0; i < n; i++) {
         if (!strcmp(types[i], "TARGETS"))
             continue;
 
-        targets[j].target = types[i];
+        has_utf8 |= !strcmp(types[i], "UTF8_STRING");
+        has_string |= !strcmp(types[i], "STRING");
+        targets[j].target = (gchar *)types[i];
         targets[j].info = j;
+        agent->clipboard_client_targets[selection][j] = types[i];
+        j++;
+    }
+
+    /* legacy X clients only know about Latin-1 STRING */
+    if (has_utf8 && !has_string) {
+        targets[j].target = "STRING";
+        targets[j].info = TARGET_INFO_LATIN1;
         j++;
     }
 
@@ -272,6 +800,8 @@ vdagent_clipboard_release(SpiceVDAgent *agent, guint8 selection)
     if (agent->clipboard_owner[selection] == OWNER_GUEST)
         return;
 
+    cancel_transfers(agent, selection);
+
     clipboard = clipboard_get(selat);
     gtk_clipboard_clear(clipboard);
     agent->clipboard_owner[selection] = OWNER_NONE;
@@ -287,6 +817,8 @@ vdagent_clipboard_release_all(SpiceVDAgent *agent)
     for (i = 0; i < G_N_ELEMENTS(agent->clipboard_owner); i++) {
         if (agent->clipboard_owner[i] == OWNER_CLIENT)
             vdagent_clipboard_release(agent, i);
+        /* a new client needs to get the full grab */
+        forget_targets(agent, i);
     }
 }
 
@@ -303,31 +835,140 @@ got_targets(GtkClipboard *clipboard,
     if (!self)
         return;
 
-    char *name;
-    int a;
+    const gchar *name;
+    int a, n;
     guint8 selection;
-    gsize size = 2;
-    GStrv targets = g_new0(gchar*, n_atoms + 1);
+    gboolean has_utf8 = FALSE, has_string = FALSE;
+    const gchar **targets, **old;
+    guint16 *ids;
 
     selection = get_selection_from_clipboard(clipboard);
 
+    /* the selection went away while we were waiting */
+    if (n_atoms <= 0 || gtk_clipboard_get_owner(clipboard) == G_OBJECT(self)) {
+        if (self->clipboard_owner[selection] == OWNER_GUEST) {
+            g_debug("sending release");
+            spice_vdagent_write_header(self, VDAGENTD_CLIPBOARD_RELEASE,
+                                       selection, 0, 0);
+            self->clipboard_owner[selection] = OWNER_NONE;
+        }
+        forget_targets(self, selection);
+        return;
+    }
+
+    targets = g_new0(const gchar*, n_atoms + 2);
     for (a = 0; a < n_atoms; a++) {
-        name = gdk_atom_name(atoms[a]);
+        name = vdagent_atoms_name(atoms[a]);
         g_debug(" \"%s\"", name);
+        has_utf8 |= !strcmp(name, "UTF8_STRING");
+        has_string |= !strcmp(name, "STRING");
         targets[a] = name;
-        size += strlen(name) + 1;
     }
 
-    spice_vdagent_write_header(self, VDAGENTD_CLIPBOARD_GRAB,
-                               selection, 0, size);
+    /* offer Latin-1 only owners as UTF8_STRING, converted on request */
+    self->clipboard_latin1[selection] = has_string && !has_utf8;
+    if (self->clipboard_latin1[selection]) {
+        targets[n_atoms++] = vdagent_atoms_intern("UTF8_STRING");
+    }
 
-    for (a = 0; a < n_atoms; a++)
-        spice_vdagent_write(self, targets[a], strlen(targets[a]) + 1, g_free);
+    qsort(targets, n_atoms, sizeof(gchar *), compare_strings);
+
+    /* Only the contents changed, let vdagentd know with an empty grab, so it
+       does not answer from its cache, the client does not need to know. A
+       new owner gets a full grab, vdagentd goes by its window. */
+    old = self->clipboard_targets[selection];
+    if (self->clipboard_owner[selection] == OWNER_GUEST && old &&
+        self->clipboard_targets_window[selection] ==
+            self->clipboard_owner_window[selection] &&
+        g_strv_length((GStrv)old) == n_atoms) {
+        /* the names are interned, so equal names are the same pointer */
+        for (a = 0; a < n_atoms && old[a] == targets[a]; a++)
+            ;
+        if (a == n_atoms) {
+            g_debug("targets unchanged");
+            spice_vdagent_write_header(self, VDAGENTD_CLIPBOARD_GRAB,
+                                       selection, 0, 0);
+            g_free(targets);
+            return;
+        }
+    }
 
-    spice_vdagent_write(self, "\0\0", 2, NULL);
+    /* new types get announced before the grab using them */
+    ids = g_new(guint16, n_atoms);
+    for (a = 0, n = 0; a < n_atoms; a++) {
+        ids[n] = type_id(self, targets[a]);
+        if (ids[n])
+            n++;
+    }
+    if (n == 0) {
+        g_free(ids);
+        g_free(targets);
+        return;
+    }
+    /* vdagentd needs the owner to tell an app re-asserting its ownership
+       from another app copying something */
+    spice_vdagent_write_msg(self, VDAGENTD_CLIPBOARD_GRAB, selection,
+                            self->clipboard_owner_window[selection],
+                            ids, n * sizeof(guint16), g_free);
 
     self->clipboard_owner[selection] = OWNER_GUEST;
-    g_free(targets);
+    forget_targets(self, selection);
+    self->clipboard_targets[selection] = targets;
+    self->clipboard_targets_window[selection] =
+        self->clipboard_owner_window[selection];
+}
+
+typedef struct _OwnerChange {
+    SpiceVDAgent *agent;
+    GtkClipboard *clipboard;
+} OwnerChange;
+
+static gboolean
+owner_change_timeout(gpointer user_data)
+{
+    OwnerChange *change = user_data;
+    SpiceVDAgent *self = change->agent;
+    guint8 selection = get_selection_from_clipboard(change->clipboard);
+
+    self->clipboard_owner_change[selection] = 0;
+
+    /* this also tells us when there's no owner anymore */
+    gtk_clipboard_request_targets(change->clipboard, got_targets,
+                                  weak_ref(G_OBJECT(self)));
+
+    return FALSE;
+}
+
+static void
+owner_change_free(gpointer user_data)
+{
+    g_slice_free(OwnerChange, user_data);
+}
+
+void
+vdagent_clipboard_regrab(SpiceVDAgent *agent, guint8 selection)
+{
+    GdkAtom selat;
+
+    g_return_if_fail(SPICE_IS_VDAGENT(agent));
+    g_debug("clipboard regrab");
+
+    /* the next grab must carry the targets */
+    forget_targets(agent, selection);
+
+    /* a pending owner change will grab soon anyway */
+    if (agent->clipboard_owner[selection] != OWNER_GUEST ||
+        agent->clipboard_owner_change[selection])
+        return;
+
+    selat = selection_atom(selection);
+    if (selat == GDK_NONE) {
+        g_debug("unknown selection:%d", selection);
+        return;
+    }
+
+    gtk_clipboard_request_targets(clipboard_get(selat), got_targets,
+                                  weak_ref(G_OBJECT(agent)));
 }
 
 static void
@@ -337,26 +978,28 @@ owner_change(GtkClipboard        *clipboard,
 {
     SpiceVDAgent *self = user_data;
     guint8 selection = get_selection_from_clipboard(clipboard);
+    OwnerChange *change;
 
     g_return_if_fail(SPICE_IS_VDAGENT(self));
 
-    if (self->clipboard_owner[selection] == OWNER_GUEST) {
-        g_debug("sending release");
-        spice_vdagent_write_header(self, VDAGENTD_CLIPBOARD_RELEASE, selection, 0, 0);
-        self->clipboard_owner[selection] = OWNER_NONE;
-    }
-
-    switch (event->reason) {
-    case GDK_OWNER_CHANGE_NEW_OWNER:
-        if (gtk_clipboard_get_owner(clipboard) == G_OBJECT(self))
-            break;
+    if (gtk_clipboard_get_owner(clipboard) == G_OBJECT(self))
+        return;
 
-        gtk_clipboard_request_targets(clipboard, got_targets,
-                                      weak_ref(G_OBJECT(self)));
-        break;
-    default:
-        break;
-    }
+    cancel_transfers(self, selection);
+    self->clipboard_owner_window[selection] =
+        event->owner ? GDK_WINDOW_XID(event->owner) : 0;
+
+    /* Selecting text with the mouse changes PRIMARY's owner many times in
+       a row, only look at the last change */
+    if (self->clipboard_owner_change[selection])
+        g_source_remove(self->clipboard_owner_change[selection]);
+
+    change = g_slice_new(OwnerChange);
+    change->agent = self;
+    change->clipboard = clipboard;
+    self->clipboard_owner_change[selection] =
+        g_timeout_add_full(G_PRIORITY_DEFAULT, OWNER_CHANGE_DELAY,
+                           owner_change_timeout, change, owner_change_free);
 }
 
 void
@@ -364,13 +1007,37 @@ vdagent_clipboard_init(SpiceVDAgent *self)
 {
     g_return_if_fail(SPICE_IS_VDAGENT(self));
 
+    gdk_window_add_filter(NULL, selection_request_filter, self);
+
+    self->clipboard_types = g_ptr_array_new_with_free_func(g_free);
+    self->clipboard_types_sent = g_hash_table_new(g_direct_hash, g_direct_equal);
+
     g_signal_connect(G_OBJECT(clipboard_get(GDK_SELECTION_CLIPBOARD)),
                      "owner-change",
                      G_CALLBACK(owner_change), self);
     g_signal_connect(G_OBJECT(clipboard_get(GDK_SELECTION_PRIMARY)),
                      "owner-change",
                      G_CALLBACK(owner_change), self);
-    g_signal_connect(G_OBJECT(clipboard_get(gdk_atom_intern("XdndSelection", FALSE))),
+    g_signal_connect(G_OBJECT(clipboard_get(vdagent_atoms_get("XdndSelection"))),
                      "owner-change",
                      G_CALLBACK(owner_change), self);
 }
+
+void
+vdagent_clipboard_finalize(SpiceVDAgent *self)
+{
+    ClipboardGet *get;
+
+    gdk_window_remove_filter(NULL, selection_request_filter, self);
+
+    while (self->clipboard_gets) {
+        get = self->clipboard_gets->data;
+        if (get->id)
+            clipboard_get_refuse(get);
+        clipboard_get_free(get);
+        self->clipboard_gets = g_list_delete_link(self->clipboard_gets,
+                                                  self->clipboard_gets);
+    }
+
+    cache_clear(self, -1);
+}
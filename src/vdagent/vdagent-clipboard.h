@@ -26,14 +26,17 @@
 G_BEGIN_DECLS
 
 void vdagent_clipboard_init             (SpiceVDAgent *agent);
+void vdagent_clipboard_finalize         (SpiceVDAgent *agent);
 void vdagent_clipboard_request          (SpiceVDAgent *agent, guint8 selection,
                                          const gchar *type);
 void vdagent_clipboard_grab             (SpiceVDAgent *agent, guint8 selection,
-                                         const GStrv types);
+                                         const gchar **types);
 void vdagent_clipboard_data             (SpiceVDAgent *agent, guint8 selection,
-                                         const gchar *type, gpointer data, gsize len);
+                                         guint32 id, const gchar *type,
+                                         gpointer data, gsize len);
 void vdagent_clipboard_release          (SpiceVDAgent *agent, guint8 selection);
 void vdagent_clipboard_release_all      (SpiceVDAgent *agent);
+void vdagent_clipboard_regrab           (SpiceVDAgent *agent, guint8 selection);
 
 G_END_DECLS
 
@@ -0,0 +1,230 @@
+/*
+ * vdagent session
+ * Copyright (C) 2026  The spice-vdagent contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "vdagent-text.h"
+
+/* Text is converted in a single pass, the bulk of it (ASCII without line
+ * ends) is copied 16 bytes at a time, everything else goes through the
+ * scalar code below. */
+
+#ifdef __SSE2__
+#define BLOCK_SIZE 16
+
+/* TRUE if the block only has ASCII chars, and no '\r' or '\n' if lineends
+ * need to be converted */
+static inline gboolean
+block_is_plain(const guint8 *p, gboolean lineend)
+{
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    int mask = _mm_movemask_epi8(v);
+
+    if (lineend) {
+        __m128i eol = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\r')),
+                                   _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+        mask |= _mm_movemask_epi8(eol);
+    }
+
+    return mask == 0;
+}
+#else
+#define BLOCK_SIZE 8
+
+static inline gboolean
+block_is_plain(const guint8 *p, gboolean lineend)
+{
+    int i;
+
+    for (i = 0; i < BLOCK_SIZE; i++)
+        if (p[i] & 0x80 || (lineend && (p[i] == '\r' || p[i] == '\n')))
+            return FALSE;
+
+    return TRUE;
+}
+#endif
+
+/* Decode the UTF-8 sequence at *p, returns the code point or -1 if it is
+ * invalid (truncated, overlong, surrogate or out of range) */
+static inline gint32
+utf8_decode(const guint8 **p, const guint8 *end)
+{
+    const guint8 *s = *p;
+    guint32 c = *s;
+    gint n, i;
+
+    if (c < 0x80) {
+        *p = s + 1;
+        return c;
+    } else if (c >= 0xc2 && c <= 0xdf) {
+        n = 1;
+        c &= 0x1f;
+    } else if (c >= 0xe0 && c <= 0xef) {
+        n = 2;
+        c &= 0x0f;
+    } else if (c >= 0xf0 && c <= 0xf4) {
+        n = 3;
+        c &= 0x07;
+    } else {
+        return -1;
+    }
+
+    if (end - s <= n)
+        return -1;
+
+    for (i = 1; i <= n; i++) {
+        if ((s[i] & 0xc0) != 0x80)
+            return -1;
+        c = (c << 6) | (s[i] & 0x3f);
+    }
+
+    if ((n == 2 && (c < 0x800 || (c >= 0xd800 && c <= 0xdfff))) ||
+        (n == 3 && (c < 0x10000 || c > 0x10ffff)))
+        return -1;
+
+    *p = s + n + 1;
+    return c;
+}
+
+gboolean
+vdagent_text_validate_utf8(const guint8 *data, gsize len)
+{
+    const guint8 *p = data, *end = data + len;
+
+    while (p < end) {
+        if (end - p >= BLOCK_SIZE && block_is_plain(p, FALSE)) {
+            p += BLOCK_SIZE;
+            continue;
+        }
+        if (utf8_decode(&p, end) < 0)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Copy UTF-8 text, with every byte which isn't part of a valid sequence
+ * replaced by U+FFFD, so the rest of the text is kept as is. */
+guint8*
+vdagent_text_repair_utf8(const guint8 *data, gsize len, gsize *out_len)
+{
+    const guint8 *p = data, *s, *end = data + len;
+    guint8 *out, *o;
+
+    /* every invalid byte becomes 3 output bytes */
+    out = o = g_malloc(len * 3 + 1);
+
+    while (p < end) {
+        if (end - p >= BLOCK_SIZE && block_is_plain(p, FALSE)) {
+            memcpy(o, p, BLOCK_SIZE);
+            o += BLOCK_SIZE;
+            p += BLOCK_SIZE;
+            continue;
+        }
+
+        s = p;
+        if (utf8_decode(&p, end) < 0) {
+            *o++ = 0xef;
+            *o++ = 0xbf;
+            *o++ = 0xbd;
+            p = s + 1;
+        } else {
+            while (s < p)
+                *o++ = *s++;
+        }
+    }
+
+    *o = '\0';
+    if (out_len)
+        *out_len = o - out;
+
+    return out;
+}
+
+/* Convert text between UTF-8 and ISO Latin-1, and / or convert its line
+ * ends. Code points which can't be represented in Latin-1 become '?'.
+ * Returns NULL if from is UTF-8 and data isn't valid UTF-8. */
+guint8*
+vdagent_text_convert(const guint8 *data, gsize len,
+                     VDAgentTextEncoding from, VDAgentTextEncoding to,
+                     VDAgentTextLineEnd lineend, gsize *out_len)
+{
+    const guint8 *p = data, *end = data + len;
+    gboolean do_lineend = lineend != VDAGENT_TEXT_LINEEND_KEEP;
+    guint8 *out, *o;
+    gint32 c;
+
+    /* every input byte becomes at most 2 output bytes */
+    out = o = g_malloc(len * 2 + 1);
+
+    while (p < end) {
+        if (end - p >= BLOCK_SIZE && block_is_plain(p, do_lineend)) {
+            memcpy(o, p, BLOCK_SIZE);
+            o += BLOCK_SIZE;
+            p += BLOCK_SIZE;
+            continue;
+        }
+
+        if (*p == '\r' && lineend == VDAGENT_TEXT_LINEEND_LF &&
+            p + 1 < end && p[1] == '\n') {
+            p++;
+            continue;
+        }
+        if (*p == '\n' && lineend == VDAGENT_TEXT_LINEEND_CRLF &&
+            (p == data || p[-1] != '\r'))
+            *o++ = '\r';
+
+        if (from == VDAGENT_TEXT_UTF8) {
+            c = utf8_decode(&p, end);
+            if (c < 0) {
+                g_free(out);
+                return NULL;
+            }
+        } else {
+            c = *p++;
+        }
+
+        if (c < 0x80) {
+            *o++ = c;
+        } else if (to == VDAGENT_TEXT_LATIN1) {
+            *o++ = c <= 0xff ? c : '?';
+        } else if (c < 0x800) {
+            *o++ = 0xc0 | (c >> 6);
+            *o++ = 0x80 | (c & 0x3f);
+        } else if (c < 0x10000) {
+            *o++ = 0xe0 | (c >> 12);
+            *o++ = 0x80 | ((c >> 6) & 0x3f);
+            *o++ = 0x80 | (c & 0x3f);
+        } else {
+            *o++ = 0xf0 | (c >> 18);
+            *o++ = 0x80 | ((c >> 12) & 0x3f);
+            *o++ = 0x80 | ((c >> 6) & 0x3f);
+            *o++ = 0x80 | (c & 0x3f);
+        }
+    }
+
+    *o = '\0';
+    if (out_len)
+        *out_len = o - out;
+
+    return out;
+}
@@ -0,0 +1,49 @@
+/*
+ * vdagent session
+ * Copyright (C) 2026  The spice-vdagent contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef VDAGENT_TEXT_H_
+#define VDAGENT_TEXT_H_
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef enum {
+    VDAGENT_TEXT_UTF8,
+    VDAGENT_TEXT_LATIN1,
+} VDAgentTextEncoding;
+
+typedef enum {
+    VDAGENT_TEXT_LINEEND_KEEP,
+    VDAGENT_TEXT_LINEEND_LF,
+    VDAGENT_TEXT_LINEEND_CRLF,
+} VDAgentTextLineEnd;
+
+gboolean vdagent_text_validate_utf8     (const guint8 *data, gsize len);
+guint8*  vdagent_text_repair_utf8       (const guint8 *data, gsize len,
+                                         gsize *out_len);
+guint8*  vdagent_text_convert           (const guint8 *data, gsize len,
+                                         VDAgentTextEncoding from,
+                                         VDAgentTextEncoding to,
+                                         VDAgentTextLineEnd lineend,
+                                         gsize *out_len);
+
+G_END_DECLS
+
+#endif
@@ -33,36 +33,73 @@
 
 #include "utils.h"
 #include "vdagent.h"
+#include "vdagent-atoms.h"
 #include "vdagent-clipboard.h"
 
 G_DEFINE_TYPE (SpiceVDAgent, spice_vdagent, G_TYPE_OBJECT);
 
+/* Size of the buffer in which queued small messages are gathered, so they
+   get written together */
+#define STAGING_SIZE 4096
+
+/* Messages up to this size are copied into the queue entry itself */
+#define MSG_INLINE_SIZE 64
+
+/* Size of the buffer messages from vdagentd are read into, larger messages
+   get a buffer of their own */
+#define READ_BUF_SIZE (64 * 1024)
+
+/* Time to wait for more monitor changes before sending the new geometry,
+   in ms */
+#define MONITORS_CHANGED_DELAY 100
+
 static const char *vdagentd_socket = "/var/run/spice-vdagentd/spice-vdagent-sock";
 static gboolean version_mismatch = FALSE;
 static gboolean quit = FALSE;
 
 static void read_new_message(SpiceVDAgent *agent);
+static void msg_free(gpointer data);
 static void send_xorg_config(SpiceVDAgent *self);
+static void monitors_changed(SpiceVDAgent *self);
 
 static void
 spice_vdagent_init(SpiceVDAgent *self)
 {
     self->cancellable = g_cancellable_new();
+    self->max_clipboard = -1;
 
     vdagent_clipboard_init(self);
 
     self->outq = g_queue_new();
+    self->staging = g_malloc(STAGING_SIZE);
+    self->rbuf = g_malloc(READ_BUF_SIZE);
 
     g_signal_connect_swapped(gdk_screen_get_default(), "monitors-changed",
-                             G_CALLBACK(send_xorg_config), self);
+                             G_CALLBACK(monitors_changed), self);
 }
 
 static void
 spice_vdagent_finalize(GObject *gobject)
 {
     SpiceVDAgent *self = SPICE_VDAGENT(gobject);
+    int i;
 
     g_signal_handlers_disconnect_by_data(gdk_screen_get_default(), self);
+    if (self->xorg_config_timeout)
+        g_source_remove(self->xorg_config_timeout);
+    g_free(self->xorg_config);
+
+    vdagent_clipboard_finalize(self);
+    for (i = 0; i < G_N_ELEMENTS(self->clipboard_cache); i++) {
+        if (self->clipboard_cache[i])
+            g_hash_table_unref(self->clipboard_cache[i]);
+        if (self->clipboard_owner_change[i])
+            g_source_remove(self->clipboard_owner_change[i]);
+        g_free(self->clipboard_targets[i]);
+        g_free(self->clipboard_client_targets[i]);
+    }
+    g_ptr_array_free(self->clipboard_types, TRUE);
+    g_hash_table_unref(self->clipboard_types_sent);
 
     g_clear_object(&self->connection);
 #ifdef G_OS_UNIX
@@ -71,7 +108,9 @@ spice_vdagent_finalize(GObject *gobject)
 #endif
 
     g_free(self->data);
-    g_queue_free_full(self->outq, g_free);
+    g_free(self->rbuf);
+    g_queue_free_full(self->outq, msg_free);
+    g_free(self->staging);
 
     if (G_OBJECT_CLASS(spice_vdagent_parent_class)->finalize)
         G_OBJECT_CLASS(spice_vdagent_parent_class)->finalize(gobject);
@@ -88,10 +127,22 @@ typedef struct _Msg {
     gsize size;
     guint8 *data;
     GFreeFunc free_func;
+    gboolean header;
+    guint8 inline_data[MSG_INLINE_SIZE];
 } Msg;
 
 static void kick_write(SpiceVDAgent *self);
 
+static void
+msg_free(gpointer data)
+{
+    Msg *msg = data;
+
+    if (msg->free_func)
+        msg->free_func(msg->data);
+    g_slice_free(Msg, msg);
+}
+
 static void
 msg_write_cb(GObject *source_object,
              GAsyncResult *res,
@@ -112,36 +163,99 @@ msg_write_cb(GObject *source_object,
         g_warning("failed to write: %s", error->message);
         g_clear_error(&error);
     } else {
-        self->pos += ret;
-        g_assert(self->pos <= msg->size);
+        gsize size = self->staging_size ? self->staging_size : msg->size;
 
-        g_debug("wrote %" G_GSSIZE_FORMAT "/%" G_GSSIZE_FORMAT, self->pos,  msg->size);
-        if (self->pos == msg->size) {
-            if (msg->free_func)
-                msg->free_func(msg->data);
-            g_slice_free(Msg, g_queue_pop_head(self->outq));
+        self->pos += ret;
+        g_assert(self->pos <= size);
+
+        g_debug("wrote %" G_GSSIZE_FORMAT "/%" G_GSSIZE_FORMAT, self->pos, size);
+        if (self->pos == size) {
+            while (self->staged--) {
+                msg_free(g_queue_pop_head(self->outq));
+            }
+            self->staged = 0;
+            self->staging_size = 0;
             self->pos = 0;
         }
         kick_write(self);
     }
 }
 
+/* Copy as many small messages from the head of outq into the staging
+   buffer as fit, so that they go out with a single write */
+static void
+stage_msgs(SpiceVDAgent *self)
+{
+    GList *l;
+
+    for (l = self->outq->head; l; l = l->next) {
+        Msg *msg = l->data;
+
+        if (self->staging_size + msg->size > STAGING_SIZE)
+            break;
+
+        memcpy(self->staging + self->staging_size, msg->data, msg->size);
+        self->staging_size += msg->size;
+        self->staged++;
+    }
+
+    /* not worth copying a single message */
+    if (self->staged == 1)
+        self->staging_size = 0;
+}
+
 static void
 kick_write(SpiceVDAgent *self)
 {
     Msg *msg = g_queue_peek_head(self->outq);
+    GOutputStream *out;
 
     if (!msg || self->writing)
         return;
 
-    GOutputStream *out = g_io_stream_get_output_stream(self->connection);
-    g_output_stream_write_async(out, msg->data + self->pos,
-                                msg->size - self->pos,
-                                G_PRIORITY_DEFAULT, self->cancellable,
-                                msg_write_cb, self);
+    if (self->staged == 0) {
+        stage_msgs(self);
+        if (self->staged == 0)
+            self->staged = 1;
+    }
+
+    out = g_io_stream_get_output_stream(self->connection);
+    if (self->staging_size)
+        g_output_stream_write_async(out, self->staging + self->pos,
+                                    self->staging_size - self->pos,
+                                    G_PRIORITY_DEFAULT, self->cancellable,
+                                    msg_write_cb, self);
+    else
+        g_output_stream_write_async(out, msg->data + self->pos,
+                                    msg->size - self->pos,
+                                    G_PRIORITY_DEFAULT, self->cancellable,
+                                    msg_write_cb, self);
     self->writing = TRUE;
 }
 
+static Msg*
+queue_msg(SpiceVDAgent *self, gpointer data, guint32 size,
+          GFreeFunc free_func)
+{
+    Msg *msg = g_slice_new(Msg);
+
+    msg->size = size;
+    msg->header = FALSE;
+    if (size <= MSG_INLINE_SIZE) {
+        memcpy(msg->inline_data, data, size);
+        msg->data = msg->inline_data;
+        msg->free_func = NULL;
+        if (free_func)
+            free_func(data);
+    } else {
+        msg->data = data;
+        msg->free_func = free_func;
+    }
+
+    g_queue_push_tail(self->outq, msg);
+    return msg;
+}
+
 void
 spice_vdagent_write(SpiceVDAgent *self,
                     gpointer data, guint32 size,
@@ -150,13 +264,7 @@ spice_vdagent_write(SpiceVDAgent *self,
     g_return_if_fail(SPICE_IS_VDAGENT(self));
     g_return_if_fail(data && size);
 
-    Msg *msg = g_slice_new(Msg);
-
-    msg->size = size;
-    msg->data = data;
-    msg->free_func = free_func;
-
-    g_queue_push_tail(self->outq, msg);
+    queue_msg(self, data, size, free_func);
     kick_write(self);
 }
 
@@ -164,15 +272,17 @@ void
 spice_vdagent_write_header(SpiceVDAgent *self,
                            guint32 type, guint32 arg1, guint32 arg2, guint32 size)
 {
+    VDAgentdHeader header;
+
     g_return_if_fail(SPICE_IS_VDAGENT(self));
 
-    VDAgentdHeader *header = g_new(VDAgentdHeader, 1);
-    header->type = type;
-    header->arg1 = arg1;
-    header->arg2 = arg2;
-    header->size = size;
+    header.type = type;
+    header.arg1 = arg1;
+    header.arg2 = arg2;
+    header.size = size;
 
-    spice_vdagent_write(self, header, sizeof(*header), g_free);
+    queue_msg(self, &header, sizeof(header), NULL)->header = TRUE;
+    kick_write(self);
 }
 
 void
@@ -189,6 +299,43 @@ spice_vdagent_write_msg(SpiceVDAgent *self,
         spice_vdagent_write(self, data, size, free_func);
 }
 
+/* Drop the queued messages of type with arg1 (ie the selection), which
+   haven't started being written yet. Returns the number of dropped messages */
+guint
+spice_vdagent_drop_pending(SpiceVDAgent *self, guint32 type, guint32 arg1)
+{
+    GList *l, *next;
+    gboolean dropping = FALSE;
+    guint n = 0, i = 0;
+
+    g_return_val_if_fail(SPICE_IS_VDAGENT(self), 0);
+
+    for (l = self->outq->head; l; l = next, i++) {
+        Msg *msg = l->data;
+        next = l->next;
+
+        if (msg->header) {
+            VDAgentdHeader *header = (VDAgentdHeader *)msg->data;
+            gboolean started = i < self->staged;
+
+            dropping = !started && header->type == type && header->arg1 == arg1;
+            if (dropping)
+                n++;
+        }
+
+        if (!dropping)
+            continue;
+
+        msg_free(msg);
+        g_queue_delete_link(self->outq, l);
+    }
+
+    if (n)
+        g_debug("dropped %u pending message(s) of type %u", n, type);
+
+    return n;
+}
+
 typedef struct _VDAgentdRes {
     int width;
     int height;
@@ -196,12 +343,15 @@ typedef struct _VDAgentdRes {
     int y;
 } VDAgentdRes;
 
+/* Send the screen geometry, unless it is the same as the last one sent */
 static void
 send_xorg_config(SpiceVDAgent *self)
 {
     GdkRectangle mon;
     int i, nres = gdk_screen_get_n_monitors(gdk_screen_get_default());
-    VDAgentdRes *res = g_new(VDAgentdRes, nres);
+    gint width = gdk_screen_width(), height = gdk_screen_height();
+    gsize size = sizeof(VDAgentdRes) * nres;
+    VDAgentdRes *res = g_new0(VDAgentdRes, nres);
 
     for (i = 0; i < nres; i++) {
         gdk_screen_get_monitor_geometry(gdk_screen_get_default(), i, &mon);
@@ -211,19 +361,74 @@ send_xorg_config(SpiceVDAgent *self)
         res[i].y = mon.y;
     }
 
+    if (self->xorg_config && width == self->xorg_config_width &&
+        height == self->xorg_config_height &&
+        size == self->xorg_config_size &&
+        !memcmp(res, self->xorg_config, size)) {
+        g_debug("screen geometry unchanged");
+        g_free(res);
+        return;
+    }
+
+    g_free(self->xorg_config);
+    self->xorg_config = g_memdup(res, size);
+    self->xorg_config_size = size;
+    self->xorg_config_width = width;
+    self->xorg_config_height = height;
+
     spice_vdagent_write_msg(self, VDAGENTD_GUEST_XORG_RESOLUTION,
-                            gdk_screen_width(), gdk_screen_height(),
-                            res, sizeof(*res) * nres, g_free);
+                            width, height, res, size, g_free);
+}
+
+static gboolean
+monitors_changed_timeout(gpointer user_data)
+{
+    SpiceVDAgent *self = user_data;
+
+    self->xorg_config_timeout = 0;
+    send_xorg_config(self);
+
+    return FALSE;
+}
+
+/* A reconfiguration usually emits several monitors-changed signals in a
+   row, only send the geometry once they stop coming */
+static void
+monitors_changed(SpiceVDAgent *self)
+{
+    if (self->xorg_config_timeout)
+        g_source_remove(self->xorg_config_timeout);
+    self->xorg_config_timeout = g_timeout_add(MONITORS_CHANGED_DELAY,
+                                              monitors_changed_timeout, self);
+}
+
+/* Return the name of the clipboard type whose id is at data[index], from the
+   atoms cache */
+static const gchar*
+type_from_data(SpiceVDAgent *agent, gconstpointer data, gsize index)
+{
+    const gchar *type = NULL;
+    guint16 id;
+
+    memcpy(&id, (const guint16 *)data + index, sizeof(id));
+    if (id < agent->clipboard_types->len)
+        type = g_ptr_array_index(agent->clipboard_types, id);
+    if (type == NULL) {
+        g_warning("unknown clipboard type id %u", id);
+        return NULL;
+    }
+
+    /* only the types which get used end up in the atoms cache */
+    return vdagent_atoms_intern(type);
 }
 
 static void
-dispatch_message(SpiceVDAgent *agent)
+dispatch_message(SpiceVDAgent *agent, gpointer data)
 {
     VDAgentdHeader *header = &agent->header;
-    gpointer data = agent->data;
-    gchar *type = NULL;
-    GStrv types = NULL;
-    gssize pos = 0;
+    const gchar *type = NULL;
+    const gchar **types = NULL;
+    gsize i, j, n = header->size / sizeof(guint16);
 
     switch (header->type) {
     case VDAGENTD_MONITORS_CONFIG:
@@ -234,21 +439,50 @@ dispatch_message(SpiceVDAgent *agent)
     case VDAGENTD_FILE_XFER_DATA:
         g_warning("file-xfer is deprecated");
         break;
+    case VDAGENTD_CLIPBOARD_TYPE:
+        type = str_from_data(data, header->size, NULL);
+        if (type == NULL || header->arg1 == 0 || header->arg1 > G_MAXUINT16) {
+            g_warning("invalid clipboard type %u", header->arg1);
+            break;
+        }
+        if (header->arg1 >= agent->clipboard_types->len)
+            g_ptr_array_set_size(agent->clipboard_types, header->arg1 + 1);
+        g_free(g_ptr_array_index(agent->clipboard_types, header->arg1));
+        g_ptr_array_index(agent->clipboard_types, header->arg1) =
+            g_strdup(type);
+        break;
     case VDAGENTD_CLIPBOARD_REQUEST:
-        type = str_from_data(data, header->size, &pos);
+        if (n)
+            type = type_from_data(agent, data, 0);
         vdagent_clipboard_request(agent, header->arg1, type);
         break;
     case VDAGENTD_CLIPBOARD_GRAB:
-        types = strv_from_data(data, header->size, &pos);
+        types = g_new0(const gchar*, n + 1);
+        for (i = 0, j = 0; i < n; i++) {
+            types[j] = type_from_data(agent, data, i);
+            if (types[j])
+                j++;
+        }
         vdagent_clipboard_grab(agent, header->arg1, types);
         break;
     case VDAGENTD_CLIPBOARD_DATA:
-        type = str_from_data(data, header->size, &pos);
-        vdagent_clipboard_data(agent, header->arg1, type, data + pos, header->size - pos);
+        if (n)
+            type = type_from_data(agent, data, 0);
+        if (type == NULL) {
+            vdagent_clipboard_data(agent, header->arg1, header->arg2,
+                                   NULL, NULL, 0);
+            break;
+        }
+        vdagent_clipboard_data(agent, header->arg1, header->arg2, type,
+                               (guint8 *)data + sizeof(guint16),
+                               header->size - sizeof(guint16));
         break;
     case VDAGENTD_CLIPBOARD_RELEASE:
         vdagent_clipboard_release(agent, header->arg1);
         break;
+    case VDAGENTD_CLIPBOARD_REGRAB:
+        vdagent_clipboard_regrab(agent, header->arg1);
+        break;
     case VDAGENTD_VERSION:
         if (g_strcmp0(data, VERSION)) {
             g_message("vdagentd version mismatch: got %s expected %s", (gchar*)data, VERSION);
@@ -259,12 +493,15 @@ dispatch_message(SpiceVDAgent *agent)
     case VDAGENTD_CLIENT_DISCONNECTED:
         vdagent_clipboard_release_all(agent);
         break;
+    case VDAGENTD_MAX_CLIPBOARD:
+        agent->max_clipboard = (gint32)header->arg1;
+        g_debug("max clipboard: %d", agent->max_clipboard);
+        break;
     default:
         g_warning("Unknown message from vdagentd type: %d, ignoring", header->type);
     }
 
-    g_free(type);
-    g_strfreev(types);
+    g_free(types);
 }
 
 static void
@@ -273,7 +510,6 @@ message_data_cb(GObject *source_object,
                 gpointer user_data)
 {
     SpiceVDAgent *agent = user_data;
-    VDAgentdHeader *header = &agent->header;
     GError *error = NULL;
     gboolean success;
     gsize bread;
@@ -282,11 +518,13 @@ message_data_cb(GObject *source_object,
     if (!success)
         g_warning("%s", error->message);
 
-    if (bread != header->size) {
+    if (bread != agent->data_size - agent->data_pos) {
         g_warning("failed to read all data, quit: %" G_GSIZE_FORMAT, bread);
         gtk_main_quit();
     } else {
-        dispatch_message(agent);
+        dispatch_message(agent, agent->data);
+        g_free(agent->data);
+        agent->data = NULL;
         read_new_message(agent);
     }
 
@@ -294,53 +532,80 @@ message_data_cb(GObject *source_object,
 }
 
 static void
-message_header_cb(GObject *source_object,
-                  GAsyncResult *res,
-                  gpointer user_data)
+read_cb(GObject *source_object,
+        GAsyncResult *res,
+        gpointer user_data)
 {
     SpiceVDAgent *agent = user_data;
-    VDAgentdHeader *header = &agent->header;
     GError *error = NULL;
-    gboolean success;
-    gsize bread;
+    gssize bread;
 
-    success = input_stream_read_all_finish (G_INPUT_STREAM(source_object), res, &bread, &error);
-    if (!success)
-        g_warning("%s", error->message);
-
-    if (bread != sizeof(*header)) {
-        g_warning("failed to read all header, quit");
+    bread = g_input_stream_read_finish(G_INPUT_STREAM(source_object), res, &error);
+    if (bread <= 0) {
+        g_warning("failed to read message, quit: %s",
+                  error ? error->message : "connection closed");
+        g_clear_error(&error);
         gtk_main_quit();
-    } else {
-        g_debug("Header type:%u size:%u (%u, %u)",
-                header->type, header->size, header->arg1, header->arg2);
+        return;
+    }
 
-        if (header->size != 0) {
-            agent->data = g_realloc(agent->data, header->size);
-            input_stream_read_all_async(g_io_stream_get_input_stream(agent->connection),
-                                        agent->data, header->size,
+    agent->rbuf_end += bread;
+    read_new_message(agent);
+}
+
+/* Dispatch all complete messages in the read buffer, then wait for more */
+static void
+read_new_message(SpiceVDAgent *agent)
+{
+    VDAgentdHeader *header = &agent->header;
+    GInputStream *in = g_io_stream_get_input_stream(agent->connection);
+    gsize avail;
+
+    while ((avail = agent->rbuf_end - agent->rbuf_start) >= sizeof(*header)) {
+        memcpy(header, agent->rbuf + agent->rbuf_start, sizeof(*header));
+
+        /* too large for the buffer, read the rest straight into its own */
+        if (header->size > READ_BUF_SIZE - sizeof(*header)) {
+            g_debug("Header type:%u size:%u (%u, %u)",
+                    header->type, header->size, header->arg1, header->arg2);
+            avail -= sizeof(*header);
+            agent->data = g_malloc(header->size);
+            agent->data_size = header->size;
+            agent->data_pos = avail;
+            memcpy(agent->data, agent->rbuf + agent->rbuf_start + sizeof(*header),
+                   avail);
+            agent->rbuf_start = agent->rbuf_end = 0;
+            input_stream_read_all_async(in, agent->data + avail,
+                                        header->size - avail,
                                         G_PRIORITY_DEFAULT,
                                         agent->cancellable,
                                         message_data_cb,
                                         agent);
-        } else {
-            dispatch_message(agent);
-            read_new_message(agent);
+            return;
         }
-    }
 
-    g_clear_error(&error);
-}
+        if (avail < sizeof(*header) + header->size)
+            break;
 
-static void
-read_new_message(SpiceVDAgent *agent)
-{
-    input_stream_read_all_async(g_io_stream_get_input_stream(agent->connection),
-                                &agent->header, sizeof(agent->header),
-                                G_PRIORITY_DEFAULT,
-                                agent->cancellable,
-                                message_header_cb,
-                                agent);
+        g_debug("Header type:%u size:%u (%u, %u)",
+                header->type, header->size, header->arg1, header->arg2);
+        agent->rbuf_start += sizeof(*header);
+        dispatch_message(agent, agent->rbuf + agent->rbuf_start);
+        agent->rbuf_start += header->size;
+    }
+
+    /* move the start of an incomplete message to the front */
+    memmove(agent->rbuf, agent->rbuf + agent->rbuf_start,
+            agent->rbuf_end - agent->rbuf_start);
+    agent->rbuf_end -= agent->rbuf_start;
+    agent->rbuf_start = 0;
+
+    g_input_stream_read_async(in, agent->rbuf + agent->rbuf_end,
+                              READ_BUF_SIZE - agent->rbuf_end,
+                              G_PRIORITY_DEFAULT,
+                              agent->cancellable,
+                              read_cb,
+                              agent);
 }
 
 /* TODO: could use dbus, but for portability maybe not..... */
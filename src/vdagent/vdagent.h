@@ -28,6 +28,8 @@
 #include <gio/gunixsocketaddress.h>
 #endif
 
+#include "vdagentd/vdagentd-proto.h"
+
 G_BEGIN_DECLS
 
 #define SPICE_TYPE_VDAGENT            (spice_vdagent_get_type ())
@@ -37,22 +39,6 @@ G_BEGIN_DECLS
 #define SPICE_IS_VDAGENT_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), SPICE_TYPE_VDAGENT))
 #define SPICE_VDAGENT_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj), SPICE_TYPE_VDAGENT, SpiceVDAgentClass))
 
-enum {
-    VDAGENTD_GUEST_XORG_RESOLUTION,
-    VDAGENTD_MONITORS_CONFIG,
-    VDAGENTD_CLIPBOARD_GRAB,
-    VDAGENTD_CLIPBOARD_REQUEST,
-    VDAGENTD_CLIPBOARD_DATA,
-    VDAGENTD_CLIPBOARD_RELEASE,
-    VDAGENTD_VERSION,
-    VDAGENTD_FILE_XFER_START,
-    VDAGENTD_FILE_XFER_STATUS,
-    VDAGENTD_FILE_XFER_DATA,
-    VDAGENTD_CLIENT_DISCONNECTED,
-
-    VDAGENTD_LAST
-};
-
 enum {
     OWNER_NONE,
     OWNER_GUEST,
@@ -76,16 +62,60 @@ typedef struct _SpiceVDAgent {
     GQueue *outq;
     gboolean writing;
     gsize pos;
+    /* the first staged messages of outq are being written, copied to
+       staging if there's more than one (staging_size is 0 otherwise) */
+    guint staged;
+    guint8 *staging;
+    gsize staging_size;
 
     VDAgentdHeader header;
-    gpointer data;
+    /* messages are read into rbuf, except for payloads too large for it */
+    guint8 *rbuf;
+    gsize rbuf_start;
+    gsize rbuf_end;
+    guint8 *data;
+    gsize data_size;
+    gsize data_pos;
+
+    /* last screen geometry sent, and the pending monitors-changed timeout */
+    gpointer xorg_config;
+    gsize xorg_config_size;
+    gint xorg_config_width;
+    gint xorg_config_height;
+    guint xorg_config_timeout;
 
     int clipboard_owner[G_MAXUINT8];
-    struct {
-        GMainLoop *loop;
-        GtkSelectionData *selection_data;
-        gint selection;
-    } clipboard_get;
+    gint max_clipboard;
+    /* bumped on every owner change, to spot stale transfers */
+    guint clipboard_generation[G_MAXUINT8];
+    /* guest owner offers STRING but no UTF8_STRING */
+    gboolean clipboard_latin1[G_MAXUINT8];
+    /* guest app requests waiting for client data, or answered and on their
+       way to GTK */
+    GList *clipboard_gets;
+    guint32 clipboard_get_id;
+    /* client data by target, per selection */
+    GHashTable *clipboard_cache[G_MAXUINT8];
+    /* all cached client data, least recently used first, and its size */
+    GQueue clipboard_cache_lru;
+    gsize clipboard_cache_size;
+    /* sorted targets of the last grab sent, per selection, the names are
+       owned by the atoms cache */
+    const gchar **clipboard_targets[G_MAXUINT8];
+    /* owner window sent with the last grab, per selection */
+    guint32 clipboard_targets_window[G_MAXUINT8];
+    /* targets of the last client grab, per selection, the names are owned
+       by the atoms cache */
+    const gchar **clipboard_client_targets[G_MAXUINT8];
+    /* pending owner change timeouts */
+    guint clipboard_owner_change[G_MAXUINT8];
+    /* X window owning the selection as of its last owner change, 0 if
+       unknown */
+    guint32 clipboard_owner_window[G_MAXUINT8];
+    /* type names announced by vdagentd, by id */
+    GPtrArray *clipboard_types;
+    /* ids of the types announced to vdagentd */
+    GHashTable *clipboard_types_sent;
 } SpiceVDAgent;
 
 typedef struct _SpiceVDAgentClass {
@@ -102,6 +132,8 @@ void spice_vdagent_write_header     (SpiceVDAgent *self,
 void spice_vdagent_write_msg        (SpiceVDAgent *self,
                                      guint32 type, guint32 arg1, guint32 arg2,
                                      gpointer data, guint32 size, GFreeFunc free_func);
+guint spice_vdagent_drop_pending    (SpiceVDAgent *self,
+                                     guint32 type, guint32 arg1);
 
 G_END_DECLS
 
@@ -33,6 +33,7 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include "udscs.h"
+#include "vdagentd-timer.h"
 
 struct udscs_buf {
     uint8_t *buf;
@@ -54,6 +55,7 @@ struct udscs_connection {
     int header_read;
     struct udscs_message_header header;
     struct udscs_buf data;
+    uint64_t message_start;
 
     /* Writes are stored in a linked list of buffers, with both the header
        + data for a single message in 1 buffer. */
@@ -355,10 +357,19 @@ void udscs_client_handle_fds(struct udscs_connection **connp, fd_set *readfds,
 
 int udscs_write(struct udscs_connection *conn, uint32_t type, uint32_t arg1,
     uint32_t arg2, const uint8_t *data, uint32_t size)
+{
+    return udscs_write_prefixed(conn, type, arg1, arg2, NULL, 0, data, size);
+}
+
+int udscs_write_prefixed(struct udscs_connection *conn, uint32_t type,
+    uint32_t arg1, uint32_t arg2, const uint8_t *prefix, uint32_t prefix_size,
+    const uint8_t *data, uint32_t size)
 {
     struct udscs_buf *wbuf, *new_wbuf;
     struct udscs_message_header header;
 
+    size += prefix_size;
+
     new_wbuf = malloc(sizeof(*new_wbuf));
     if (!new_wbuf)
         return -1;
@@ -378,7 +389,9 @@ int udscs_write(struct udscs_connection *conn, uint32_t type, uint32_t arg1,
     header.size = size;
 
     memcpy(new_wbuf->buf, &header, sizeof(header));
-    memcpy(new_wbuf->buf + sizeof(header), data, size);
+    memcpy(new_wbuf->buf + sizeof(header), prefix, prefix_size);
+    memcpy(new_wbuf->buf + sizeof(header) + prefix_size, data,
+           size - prefix_size);
 
     if (conn->debug) {
         if (type < conn->no_types)
@@ -405,6 +418,91 @@ int udscs_write(struct udscs_connection *conn, uint32_t type, uint32_t arg1,
     return 0;
 }
 
+int udscs_drop_pending(struct udscs_connection *conn, uint32_t arg1,
+        uint32_t type_mask)
+{
+    struct udscs_buf *wbuf, **wbufp;
+    struct udscs_message_header *header;
+    int dropped = 0;
+
+    if (!conn)
+        return 0;
+
+    wbufp = &conn->write_buf;
+    while ((wbuf = *wbufp)) {
+        header = (struct udscs_message_header *)wbuf->buf;
+        /* Never touch a message which is (partially) on the wire already */
+        if (wbuf->pos != 0 || header->arg1 != arg1 ||
+                header->type >= 32 || !(type_mask & (1 << header->type))) {
+            wbufp = &wbuf->next;
+            continue;
+        }
+
+        if (conn->debug)
+            syslog(LOG_DEBUG, "%p dropped superseded %s, arg1: %u, size %u",
+                   conn, header->type < conn->no_types ?
+                       conn->type_to_string[header->type] : "invalid message",
+                   header->arg1, header->size);
+
+        *wbufp = wbuf->next;
+        free(wbuf->buf);
+        free(wbuf);
+        dropped++;
+    }
+
+    return dropped;
+}
+
+int udscs_empty_pending(struct udscs_connection *conn, uint32_t arg1,
+        uint32_t type_mask)
+{
+    struct udscs_buf *wbuf;
+    struct udscs_message_header *header;
+    int emptied = 0;
+
+    if (!conn)
+        return 0;
+
+    for (wbuf = conn->write_buf; wbuf; wbuf = wbuf->next) {
+        header = (struct udscs_message_header *)wbuf->buf;
+        if (wbuf->pos != 0 || header->arg1 != arg1 || header->size == 0 ||
+                header->type >= 32 || !(type_mask & (1 << header->type)))
+            continue;
+
+        if (conn->debug)
+            syslog(LOG_DEBUG, "%p emptied superseded %s, arg1: %u, size %u",
+                   conn, header->type < conn->no_types ?
+                       conn->type_to_string[header->type] : "invalid message",
+                   header->arg1, header->size);
+
+        /* Keep the buffer, only the part after the header gets ignored */
+        header->size = 0;
+        wbuf->size = sizeof(*header);
+        emptied++;
+    }
+
+    return emptied;
+}
+
+size_t udscs_get_pending_size(struct udscs_connection *conn)
+{
+    struct udscs_buf *wbuf;
+    size_t size = 0;
+
+    if (!conn)
+        return 0;
+
+    for (wbuf = conn->write_buf; wbuf; wbuf = wbuf->next)
+        size += wbuf->size - wbuf->pos;
+
+    return size;
+}
+
+uint64_t udscs_get_message_start(struct udscs_connection *conn)
+{
+    return conn->message_start;
+}
+
 int udscs_server_write_all(struct udscs_server *server,
         uint32_t type, uint32_t arg1, uint32_t arg2,
         const uint8_t *data, uint32_t size)
@@ -494,6 +592,9 @@ static void udscs_do_read(struct udscs_connection **connp)
         return;
     }
 
+    if (conn->header_read == 0)
+        conn->message_start = vdagentd_timer_get_time();
+
     if (conn->header_read < sizeof(conn->header)) {
         conn->header_read += n;
         if (conn->header_read == sizeof(conn->header)) {
@@ -103,6 +103,37 @@ void udscs_client_handle_fds(struct udscs_connection **connp, fd_set *readfds,
 int udscs_write(struct udscs_connection *conn, uint32_t type, uint32_t arg1,
         uint32_t arg2, const uint8_t *data, uint32_t size);
 
+/* Like udscs_write, but the message data is prefix followed by data */
+int udscs_write_prefixed(struct udscs_connection *conn, uint32_t type,
+        uint32_t arg1, uint32_t arg2, const uint8_t *prefix,
+        uint32_t prefix_size, const uint8_t *data, uint32_t size);
+
+/* Drop all messages queued for delivery to the client connected through conn
+   which have not started being written yet, have arg1 as arg1 (ie the
+   clipboard selection) and a type which is set in type_mask (1 << type).
+   This allows dropping messages which have been superseded by a newer one.
+
+   Returns the number of dropped messages */
+int udscs_drop_pending(struct udscs_connection *conn, uint32_t arg1,
+        uint32_t type_mask);
+
+/* Like udscs_drop_pending, but instead of dropping the messages strip their
+   data, so that the peer still gets a message with the same header
+   arguments, ie an empty answer to one of its requests.
+
+   Returns the number of emptied messages */
+int udscs_empty_pending(struct udscs_connection *conn, uint32_t arg1,
+        uint32_t type_mask);
+
+/* Return the number of bytes queued for delivery to the client connected
+   through conn, which have not been written yet */
+size_t udscs_get_pending_size(struct udscs_connection *conn);
+
+/* For use from the read callback: return the time (in milliseconds, see
+   vdagentd_timer_get_time) at which the first byte of the message being
+   handled was read */
+uint64_t udscs_get_message_start(struct udscs_connection *conn);
+
 /* Like udscs_write, but then send the message to all clients connected to
    the server */
 int udscs_server_write_all(struct udscs_server *server,
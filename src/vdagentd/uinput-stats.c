@@ -0,0 +1,165 @@
+/*  uinput-stats.c analyse a mouse event recording from spice-vdagentd -r
+
+    Copyright 2026 The spice-vdagent contributors
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <spice/vd_agent.h>
+#include "vdagentd-uinput.h"
+
+/* Latencies of the recorded messages, in microseconds */
+struct latencies {
+    uint64_t *values;
+    unsigned int count;
+    unsigned int size;
+};
+
+static int latencies_add(struct latencies *lat, uint64_t value)
+{
+    uint64_t *values;
+
+    if (lat->count == lat->size) {
+        lat->size = lat->size ? lat->size * 2 : 1024;
+        values = realloc(lat->values, lat->size * sizeof(*values));
+        if (!values) {
+            fprintf(stderr, "out of memory\n");
+            return -1;
+        }
+        lat->values = values;
+    }
+    lat->values[lat->count++] = value;
+
+    return 0;
+}
+
+static int compare_values(const void *a, const void *b)
+{
+    uint64_t va = *(const uint64_t *)a, vb = *(const uint64_t *)b;
+
+    return va < vb ? -1 : va > vb;
+}
+
+static void latencies_print(struct latencies *lat, const char *name)
+{
+    uint64_t sum = 0;
+    unsigned int i;
+
+    if (lat->count == 0) {
+        printf("%-20s no data\n", name);
+        return;
+    }
+
+    qsort(lat->values, lat->count, sizeof(*lat->values), compare_values);
+    for (i = 0; i < lat->count; i++)
+        sum += lat->values[i];
+
+    printf("%-20s min %llu avg %llu p50 %llu p90 %llu p99 %llu max %llu us\n",
+           name,
+           (unsigned long long)lat->values[0],
+           (unsigned long long)(sum / lat->count),
+           (unsigned long long)lat->values[lat->count / 2],
+           (unsigned long long)lat->values[lat->count * 9 / 10],
+           (unsigned long long)lat->values[lat->count * 99 / 100],
+           (unsigned long long)lat->values[lat->count - 1]);
+}
+
+int main(int argc, char *argv[])
+{
+    struct vdagentd_uinput_record rec;
+    struct latencies queue = { 0, }, inject = { 0, }, total = { 0, };
+    uint64_t first = 0, last = 0;
+    unsigned int events = 0, messages = 0, missing = 0;
+    uint32_t msg_id = 0;
+    double secs;
+    FILE *f = stdin;
+    int ret = 1;
+
+    if (argc > 2 || (argc == 2 && !strcmp(argv[1], "-h"))) {
+        fprintf(stderr, "Usage: %s [recording]\n\n"
+                "Print the latencies and throughput of the mouse events "
+                "recorded by\nspice-vdagentd -r -u <recording>, read from "
+                "stdin if no file is given.\n", argv[0]);
+        return argc == 2 ? 0 : 1;
+    }
+
+    if (argc == 2) {
+        f = fopen(argv[1], "r");
+        if (!f) {
+            perror(argv[1]);
+            return 1;
+        }
+    }
+
+    while (fread(&rec, sizeof(rec), 1, f) == 1) {
+        events++;
+        if (events == 1 || rec.written > last)
+            last = rec.written;
+
+        /* all events of a message carry the same times */
+        if (messages && rec.msg_id == msg_id)
+            continue;
+
+        if (messages && rec.msg_id > msg_id + 1)
+            missing += rec.msg_id - msg_id - 1;
+        msg_id = rec.msg_id;
+        messages++;
+
+        if (rec.read) {
+            if (!first || rec.read < first)
+                first = rec.read;
+            if (latencies_add(&queue, rec.dispatch - rec.read) ||
+                    latencies_add(&total, rec.written - rec.read))
+                goto out;
+        } else if (!first || rec.dispatch < first) {
+            first = rec.dispatch;
+        }
+        if (latencies_add(&inject, rec.written - rec.dispatch))
+            goto out;
+    }
+    if (ferror(f)) {
+        perror("read");
+        goto out;
+    }
+
+    secs = last > first ? (last - first) / 1000000.0 : 0;
+    printf("%u events from %u mouse messages in %.3f s", events, messages,
+           secs);
+    if (secs > 0)
+        printf(", %.1f messages/s, %.1f events/s", messages / secs,
+               events / secs);
+    printf("\n");
+    if (missing)
+        printf("%u messages wrote no events (coalesced or dropped)\n",
+               missing);
+
+    latencies_print(&queue, "read to dispatch");
+    latencies_print(&inject, "dispatch to write");
+    latencies_print(&total, "read to write");
+    ret = 0;
+
+out:
+    free(queue.values);
+    free(inject.values);
+    free(total.values);
+    if (f != stdin)
+        fclose(f);
+    return ret;
+}
@@ -30,6 +30,8 @@
 #include <sys/un.h>
 
 #include "vdagent-virtio-port.h"
+#include "vdagentd-compress.h"
+#include "vdagentd-timer.h"
 
 #define VDP_LAST_PORT VDP_SERVER_PORT
 
@@ -39,6 +41,11 @@ struct vdagent_virtio_port_buf {
     size_t size;
     size_t write_pos;
 
+    /* What the message is about, for dropping superseded messages */
+    uint32_t port_nr;
+    uint32_t message_type;
+    int selection;
+
     struct vdagent_virtio_port_buf *next;
 };
 
@@ -49,12 +56,21 @@ struct vdagent_virtio_port_chunk_port_data {
     int message_data_pos;
     VDAgentMessage message_header;
     uint8_t *message_data;
+    uint64_t message_start; /* in microseconds */
+    /* Set instead of message_data for messages which get decompressed */
+    struct vdagentd_decompress *decompress;
 };
 
 struct vdagent_virtio_port {
     int fd;
     int opening;
     int is_uds;
+    /* Set when reading is done by a reader thread through
+       vdagent_virtio_port_read rather than from the select() main loop */
+    int external_read;
+    /* Armed while waiting for the port to become connected on open, we
+       don't poll the port for reading during this */
+    struct vdagentd_timer *open_timer;
 
     /* Chunk read stuff, single buffer, separate header and data buffer */
     int chunk_header_read;
@@ -72,14 +88,22 @@ struct vdagent_virtio_port {
     /* Callbacks */
     vdagent_virtio_port_read_callback read_callback;
     vdagent_virtio_port_disconnect_callback disconnect_callback;
+    vdagent_virtio_port_decompress_callback decompress_callback;
 };
 
 static void vdagent_virtio_port_do_write(struct vdagent_virtio_port **vportp);
-static void vdagent_virtio_port_do_read(struct vdagent_virtio_port **vportp);
+static int vdagent_virtio_port_do_read(struct vdagent_virtio_port *vport,
+    vdagent_virtio_port_message_callback callback, void *user_data);
+
+static void vdagent_virtio_port_open_timeout(void *user_data)
+{
+    /* Nothing to do, the port gets polled for reading again */
+}
 
 struct vdagent_virtio_port *vdagent_virtio_port_create(const char *portname,
     vdagent_virtio_port_read_callback read_callback,
-    vdagent_virtio_port_disconnect_callback disconnect_callback)
+    vdagent_virtio_port_disconnect_callback disconnect_callback,
+    vdagent_virtio_port_decompress_callback decompress_callback)
 {
     struct vdagent_virtio_port *vport;
     struct sockaddr_un address;
@@ -89,6 +113,13 @@ struct vdagent_virtio_port *vdagent_virtio_port_create(const char *portname,
     if (!vport)
         return 0;
 
+    vport->open_timer = vdagentd_timer_create(vdagent_virtio_port_open_timeout,
+                                              vport);
+    if (!vport->open_timer) {
+        free(vport);
+        return 0;
+    }
+
     vport->fd = open(portname, O_RDWR);
     if (vport->fd == -1) {
         vport->fd = socket(PF_UNIX, SOCK_STREAM, 0);
@@ -110,6 +141,7 @@ struct vdagent_virtio_port *vdagent_virtio_port_create(const char *portname,
 
     vport->read_callback = read_callback;
     vport->disconnect_callback = disconnect_callback;
+    vport->decompress_callback = decompress_callback;
 
     return vport;
 
@@ -118,6 +150,7 @@ error:
     if (vport->fd != -1) {
         close(vport->fd);
     }
+    vdagentd_timer_destroy(&vport->open_timer);
     free(vport);
     return NULL;
 }
@@ -144,8 +177,10 @@ void vdagent_virtio_port_destroy(struct vdagent_virtio_port **vportp)
 
     for (i = 0; i <= VDP_LAST_PORT; i++) {
         free(vport->port_data[i].message_data);
+        vdagentd_decompress_destroy(&vport->port_data[i].decompress);
     }
 
+    vdagentd_timer_destroy(&vport->open_timer);
     close(vport->fd);
     free(vport);
     *vportp = NULL;
@@ -157,21 +192,47 @@ int vdagent_virtio_port_fill_fds(struct vdagent_virtio_port *vport,
     if (!vport)
         return -1;
 
-    FD_SET(vport->fd, readfds);
+    if (!vport->external_read &&
+            !vdagentd_timer_is_active(vport->open_timer))
+        FD_SET(vport->fd, readfds);
     if (vport->write_buf)
         FD_SET(vport->fd, writefds);
 
     return vport->fd + 1;
 }
 
+static int vdagent_virtio_port_call_read_callback(void *user_data,
+    int port_nr, VDAgentMessage *message_header, uint8_t *data,
+    uint64_t message_start)
+{
+    struct vdagent_virtio_port *vport = user_data;
+
+    if (!vport->read_callback)
+        return 0;
+
+    return vport->read_callback(vport, port_nr, message_header, data);
+}
+
 void vdagent_virtio_port_handle_fds(struct vdagent_virtio_port **vportp,
         fd_set *readfds, fd_set *writefds)
 {
+    int r;
+
     if (!*vportp)
         return;
 
-    if (FD_ISSET((*vportp)->fd, readfds))
-        vdagent_virtio_port_do_read(vportp);
+    if (!(*vportp)->external_read && FD_ISSET((*vportp)->fd, readfds)) {
+        r = vdagent_virtio_port_do_read(*vportp,
+                                        vdagent_virtio_port_call_read_callback,
+                                        *vportp);
+        if (r == 1) {
+            /* Don't busy wait for the host side to open the port, see
+               vdagent_virtio_port_do_read */
+            vdagentd_timer_start((*vportp)->open_timer, 10, 0);
+        } else if (r == -1) {
+            vdagent_virtio_port_destroy(vportp);
+        }
+    }
 
     if (*vportp && FD_ISSET((*vportp)->fd, writefds))
         vdagent_virtio_port_do_write(vportp);
@@ -209,6 +270,9 @@ int vdagent_virtio_port_write_start(
 
     new_wbuf->pos = 0;
     new_wbuf->write_pos = 0;
+    new_wbuf->port_nr = port_nr;
+    new_wbuf->message_type = message_type;
+    new_wbuf->selection = -1;
     new_wbuf->size = sizeof(chunk_header) + sizeof(message_header) + data_size;
     new_wbuf->next = NULL;
     new_wbuf->buf = malloc(new_wbuf->size);
@@ -263,6 +327,68 @@ int vdagent_virtio_port_write_append(struct vdagent_virtio_port *vport,
     return 0;
 }
 
+uint8_t *vdagent_virtio_port_write_buffer(
+        struct vdagent_virtio_port *vport,
+        uint32_t *size)
+{
+    struct vdagent_virtio_port_buf *wbuf;
+
+    wbuf = vdagent_virtio_port_get_last_wbuf(vport);
+    if (!wbuf) {
+        syslog(LOG_ERR, "can't fill in without a buffer");
+        return NULL;
+    }
+
+    *size = wbuf->size - wbuf->write_pos;
+    return wbuf->buf + wbuf->write_pos;
+}
+
+int vdagent_virtio_port_write_end(
+        struct vdagent_virtio_port *vport,
+        uint32_t size)
+{
+    struct vdagent_virtio_port_buf *wbuf;
+    VDIChunkHeader chunk_header;
+    VDAgentMessage message_header;
+    uint32_t shrink;
+    uint8_t *buf;
+
+    wbuf = vdagent_virtio_port_get_last_wbuf(vport);
+    if (!wbuf) {
+        syslog(LOG_ERR, "can't end without a buffer");
+        return -1;
+    }
+
+    if (wbuf->size - wbuf->write_pos < size) {
+        syslog(LOG_ERR, "can't end past the end of the buffer");
+        return -1;
+    }
+
+    wbuf->write_pos += size;
+    shrink = wbuf->size - wbuf->write_pos;
+    if (!shrink)
+        return 0;
+
+    /* The message has not been (partially) written yet, as it was not
+       complete, so its headers can still be changed */
+    memcpy(&chunk_header, wbuf->buf, sizeof(chunk_header));
+    chunk_header.size -= shrink;
+    memcpy(wbuf->buf, &chunk_header, sizeof(chunk_header));
+
+    memcpy(&message_header, wbuf->buf + sizeof(chunk_header),
+           sizeof(message_header));
+    message_header.size -= shrink;
+    memcpy(wbuf->buf + sizeof(chunk_header), &message_header,
+           sizeof(message_header));
+
+    wbuf->size = wbuf->write_pos;
+    buf = realloc(wbuf->buf, wbuf->size);
+    if (buf)
+        wbuf->buf = buf;
+
+    return 0;
+}
+
 int vdagent_virtio_port_write(
         struct vdagent_virtio_port *vport,
         uint32_t port_nr,
@@ -279,6 +405,83 @@ int vdagent_virtio_port_write(
     return 0;
 }
 
+void vdagent_virtio_port_write_set_selection(
+        struct vdagent_virtio_port *vport,
+        int selection)
+{
+    struct vdagent_virtio_port_buf *wbuf;
+
+    wbuf = vdagent_virtio_port_get_last_wbuf(vport);
+    if (!wbuf) {
+        syslog(LOG_ERR, "can't set selection without a buffer");
+        return;
+    }
+
+    wbuf->selection = selection;
+}
+
+int vdagent_virtio_port_drop_pending(
+        struct vdagent_virtio_port *vport,
+        uint32_t port_nr,
+        int selection,
+        uint32_t type_mask)
+{
+    struct vdagent_virtio_port_buf *wbuf, **wbufp;
+    int dropped = 0;
+
+    if (!vport)
+        return 0;
+
+    wbufp = &vport->write_buf;
+    while ((wbuf = *wbufp)) {
+        /* Never touch a message which is (partially) on the wire already,
+           nor one which is still being assembled with write_append */
+        if (wbuf->pos != 0 || wbuf->write_pos != wbuf->size ||
+                wbuf->port_nr != port_nr || wbuf->selection != selection ||
+                wbuf->message_type >= 32 ||
+                !(type_mask & (1 << wbuf->message_type))) {
+            wbufp = &wbuf->next;
+            continue;
+        }
+
+        *wbufp = wbuf->next;
+        free(wbuf->buf);
+        free(wbuf);
+        dropped++;
+    }
+
+    return dropped;
+}
+
+size_t vdagent_virtio_port_get_pending_size(struct vdagent_virtio_port *vport)
+{
+    struct vdagent_virtio_port_buf *wbuf;
+    size_t size = 0;
+
+    if (!vport)
+        return 0;
+
+    for (wbuf = vport->write_buf; wbuf; wbuf = wbuf->next)
+        size += wbuf->size - wbuf->pos;
+
+    return size;
+}
+
+uint64_t vdagent_virtio_port_get_message_start(
+        struct vdagent_virtio_port *vport, int port)
+{
+    return vdagent_virtio_port_get_message_start_us(vport, port) / 1000;
+}
+
+uint64_t vdagent_virtio_port_get_message_start_us(
+        struct vdagent_virtio_port *vport, int port)
+{
+    if (port > VDP_LAST_PORT)
+        return 0;
+
+    return vport->port_data[port].message_start;
+}
+
 void vdagent_virtio_port_flush(struct vdagent_virtio_port **vportp)
 {
     while (*vportp && (*vportp)->write_buf)
@@ -292,16 +495,20 @@ void vdagent_virtio_port_reset(struct vdagent_virtio_port *vport, int port)
         return;
     }
     free(vport->port_data[port].message_data);
+    vdagentd_decompress_destroy(&vport->port_data[port].decompress);
     memset(&vport->port_data[port], 0, sizeof(vport->port_data[0]));
 }
 
-static void vdagent_virtio_port_do_chunk(struct vdagent_virtio_port **vportp)
+static int vdagent_virtio_port_do_chunk(struct vdagent_virtio_port *vport,
+    vdagent_virtio_port_message_callback callback, void *user_data)
 {
     int avail, read, pos = 0;
-    struct vdagent_virtio_port *vport = *vportp;
     struct vdagent_virtio_port_chunk_port_data *port =
         &vport->port_data[vport->chunk_header.port];
 
+    if (port->message_header_read == 0)
+        port->message_start = vdagentd_timer_get_time_us();
+
     if (port->message_header_read < sizeof(port->message_header)) {
         read = sizeof(port->message_header) - port->message_header_read;
         if (read > vport->chunk_header.size) {
@@ -311,12 +518,16 @@ static void vdagent_virtio_port_do_chunk(struct vdagent_virtio_port **vportp)
                vport->chunk_data, read);
         port->message_header_read += read;
         if (port->message_header_read == sizeof(port->message_header) &&
-                port->message_header.size) {
+                vport->decompress_callback)
+            port->decompress = vport->decompress_callback(vport,
+                                   vport->chunk_header.port,
+                                   &port->message_header);
+        if (port->message_header_read == sizeof(port->message_header) &&
+                port->message_header.size && !port->decompress) {
             port->message_data = malloc(port->message_header.size);
             if (!port->message_data) {
                 syslog(LOG_ERR, "out of memory, disconnecting virtio");
-                vdagent_virtio_port_destroy(vportp);
-                return;
+                return -1;
             }
         }
         pos = read;
@@ -328,34 +539,45 @@ static void vdagent_virtio_port_do_chunk(struct vdagent_virtio_port **vportp)
 
         if (avail > read) {
             syslog(LOG_ERR, "chunk larger then message, lost sync?");
-            vdagent_virtio_port_destroy(vportp);
-            return;
+            return -1;
         }
 
         if (avail < read)
             read = avail;
 
         if (read) {
-            memcpy(port->message_data + port->message_data_pos,
-                   vport->chunk_data + pos, read);
+            if (port->decompress)
+                vdagentd_decompress_feed(port->decompress,
+                                         vport->chunk_data + pos, read);
+            else
+                memcpy(port->message_data + port->message_data_pos,
+                       vport->chunk_data + pos, read);
             port->message_data_pos += read;
         }
 
         if (port->message_data_pos == port->message_header.size) {
-            if (vport->read_callback) {
-                int r = vport->read_callback(vport, vport->chunk_header.port,
-                                 &port->message_header, port->message_data);
-                if (r == -1) {
-                    vdagent_virtio_port_destroy(vportp);
-                    return;
-                }
+            VDAgentMessage message_header = port->message_header;
+            uint32_t size;
+            int r;
+
+            if (port->decompress) {
+                port->message_data = vdagentd_decompress_finish(
+                                         &port->decompress, &size);
+                message_header.size = size;
             }
+            r = callback(user_data, vport->chunk_header.port,
+                         &message_header, port->message_data,
+                         port->message_start);
+            if (r == -1)
+                return -1;
             port->message_header_read = 0;
             port->message_data_pos = 0;
             free(port->message_data);
             port->message_data = NULL;
         }
     }
+
+    return 0;
 }
 
 static int vport_read(struct vdagent_virtio_port *vport, uint8_t *buf, int len)
@@ -367,12 +589,14 @@ static int vport_read(struct vdagent_virtio_port *vport, uint8_t *buf, int len)
     }
 }
 
-static void vdagent_virtio_port_do_read(struct vdagent_virtio_port **vportp)
+/* Returns 0 on success, 1 if the port is not open on the host side yet and
+   -1 on errors, after which the port must be destroyed */
+static int vdagent_virtio_port_do_read(struct vdagent_virtio_port *vport,
+    vdagent_virtio_port_message_callback callback, void *user_data)
 {
     ssize_t n;
     size_t to_read;
     uint8_t *dest;
-    struct vdagent_virtio_port *vport = *vportp;
 
     if (vport->chunk_header_read < sizeof(vport->chunk_header)) {
         to_read = sizeof(vport->chunk_header) - vport->chunk_header_read;
@@ -385,7 +609,7 @@ static void vdagent_virtio_port_do_read(struct vdagent_virtio_port **vportp)
     n = vport_read(vport, dest, to_read);
     if (n < 0) {
         if (errno == EINTR)
-            return;
+            return 0;
         syslog(LOG_ERR, "reading from vdagent virtio port: %m");
     }
     if (n == 0 && vport->opening) {
@@ -407,15 +631,13 @@ static void vdagent_virtio_port_do_read(struct vdagent_virtio_port **vportp)
            that the channel is closed we will hit a race here.
 
            Therefore we ignore read returning 0 until we've successfully read
-           or written some data. If we hit this race we also sleep a bit here
-           to avoid busy waiting until the above steps complete */
-        usleep(10000);
-        return;
-    }
-    if (n <= 0) {
-        vdagent_virtio_port_destroy(vportp);
-        return;
+           or written some data. If we hit this race we also stop polling
+           the port for reading for a bit, to avoid busy waiting until the
+           above steps complete */
+        return 1;
     }
+    if (n <= 0)
+        return -1;
     vport->opening = 0;
 
     if (vport->chunk_header_read < sizeof(vport->chunk_header)) {
@@ -424,26 +646,42 @@ static void vdagent_virtio_port_do_read(struct vdagent_virtio_port **vportp)
             if (vport->chunk_header.size > VD_AGENT_MAX_DATA_SIZE) {
                 syslog(LOG_ERR, "chunk size %u too large",
                        vport->chunk_header.size);
-                vdagent_virtio_port_destroy(vportp);
-                return;
+                return -1;
             }
             if (vport->chunk_header.port > VDP_LAST_PORT) {
                 syslog(LOG_ERR, "chunk port %u out of range",
                        vport->chunk_header.port);
-                vdagent_virtio_port_destroy(vportp);
-                return;
+                return -1;
             }
         }
     } else {
         vport->chunk_data_pos += n;
         if (vport->chunk_data_pos == vport->chunk_header.size) {
-            vdagent_virtio_port_do_chunk(vportp);
-            if (!*vportp)
-                return;
+            if (vdagent_virtio_port_do_chunk(vport, callback, user_data))
+                return -1;
             vport->chunk_header_read = 0;
             vport->chunk_data_pos = 0;
         }
     }
+
+    return 0;
+}
+
+void vdagent_virtio_port_set_external_read(struct vdagent_virtio_port *vport,
+                                           int external_read)
+{
+    vport->external_read = external_read;
+}
+
+int vdagent_virtio_port_get_fd(struct vdagent_virtio_port *vport)
+{
+    return vport->fd;
+}
+
+int vdagent_virtio_port_read(struct vdagent_virtio_port *vport,
+    vdagent_virtio_port_message_callback callback, void *user_data)
+{
+    return vdagent_virtio_port_do_read(vport, callback, user_data);
 }
 
 static int vport_write(struct vdagent_virtio_port *vport, uint8_t *buf, int len)
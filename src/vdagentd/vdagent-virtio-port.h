@@ -28,6 +28,7 @@
 #include <spice/vd_agent.h>
 
 struct vdagent_virtio_port;
+struct vdagentd_decompress;
 
 /* Callbacks with this type will be called when a complete message has been
    received. Sometimes the callback may want to close the port, in this
@@ -51,10 +52,34 @@ typedef void (*vdagent_virtio_port_disconnect_callback)(
     struct vdagent_virtio_port *conn);
 
 
-/* Create a vdagent virtio port object for port portname */
+/* Callbacks with this type will be called when the header of a message has
+   been received, before its data. They may return a decompressor (see
+   vdagentd_decompress_create), the data of the message then gets decompressed
+   block by block as it is received, and the read callback gets the
+   decompressed data with a message header giving its size. Return NULL to
+   receive the data as is. */
+typedef struct vdagentd_decompress *(*vdagent_virtio_port_decompress_callback)(
+    struct vdagent_virtio_port *vport,
+    int port_nr,
+    VDAgentMessage *message_header);
+
+/* Callbacks with this type get complete messages read with
+   vdagent_virtio_port_read. message_start is the time (in microseconds, see
+   vdagentd_timer_get_time_us) at which the first chunk of the message was
+   read. Return -1 to have vdagent_virtio_port_read fail, 0 otherwise. */
+typedef int (*vdagent_virtio_port_message_callback)(
+    void *user_data,
+    int port_nr,
+    VDAgentMessage *message_header,
+    uint8_t *data,
+    uint64_t message_start);
+
+/* Create a vdagent virtio port object for port portname, decompress_callback
+   may be NULL */
 struct vdagent_virtio_port *vdagent_virtio_port_create(const char *portname,
     vdagent_virtio_port_read_callback read_callback,
-    vdagent_virtio_port_disconnect_callback disconnect_callback);
+    vdagent_virtio_port_disconnect_callback disconnect_callback,
+    vdagent_virtio_port_decompress_callback decompress_callback);
     
 /* The contents of portp will be made NULL */
 void vdagent_virtio_port_destroy(struct vdagent_virtio_port **vportp);
@@ -90,6 +115,22 @@ int vdagent_virtio_port_write_append(
         const uint8_t *data,
         uint32_t size);
 
+/* For filling in the message last queued with vdagent_virtio_port_write_start
+   in place: return a pointer to the part of it which has not been written
+   yet, and the size of that part in size. Returns NULL on error */
+uint8_t *vdagent_virtio_port_write_buffer(
+        struct vdagent_virtio_port *vport,
+        uint32_t *size);
+
+/* Mark the first size bytes returned by vdagent_virtio_port_write_buffer as
+   written and end the message there, shrinking it if it was started with
+   a larger data_size.
+
+   Returns 0 on success -1 on error */
+int vdagent_virtio_port_write_end(
+        struct vdagent_virtio_port *vport,
+        uint32_t size);
+
 int vdagent_virtio_port_write(
         struct vdagent_virtio_port *vport,
         uint32_t port_nr,
@@ -98,6 +139,58 @@ int vdagent_virtio_port_write(
         const uint8_t *data,
         uint32_t data_size);
 
+/* Tag the message last queued with vdagent_virtio_port_write_start with the
+   clipboard selection it is about, see vdagent_virtio_port_drop_pending */
+void vdagent_virtio_port_write_set_selection(
+        struct vdagent_virtio_port *vport,
+        int selection);
+
+/* Drop all messages queued for port_nr which have not started being written
+   yet, are tagged with selection and have a message type which is set in
+   type_mask (1 << message_type). This allows dropping messages which have
+   been superseded by a newer one.
+
+   Returns the number of dropped messages */
+int vdagent_virtio_port_drop_pending(
+        struct vdagent_virtio_port *vport,
+        uint32_t port_nr,
+        int selection,
+        uint32_t type_mask);
+
+/* Return the number of bytes queued for delivery which have not been written
+   yet */
+size_t vdagent_virtio_port_get_pending_size(struct vdagent_virtio_port *vport);
+
+/* For use from the read callback: return the time (in milliseconds, see
+   vdagentd_timer_get_time) at which the first chunk of the message being
+   handled for port was read */
+uint64_t vdagent_virtio_port_get_message_start(
+        struct vdagent_virtio_port *vport, int port);
+/* Same as vdagent_virtio_port_get_message_start, but in microseconds */
+uint64_t vdagent_virtio_port_get_message_start_us(
+        struct vdagent_virtio_port *vport, int port);
+
+/* Hand reading from the port over to a reader thread (or take it back).
+   While external_read is set vdagent_virtio_port_fill_fds and
+   vdagent_virtio_port_handle_fds only take care of writing, and the reader
+   thread must poll the fd returned by vdagent_virtio_port_get_fd and call
+   vdagent_virtio_port_read when it is readable. Only the reader thread may
+   then call vdagent_virtio_port_reset and
+   vdagent_virtio_port_get_message_start, and the decompress callback gets
+   called from the reader thread. */
+void vdagent_virtio_port_set_external_read(struct vdagent_virtio_port *vport,
+                                           int external_read);
+int vdagent_virtio_port_get_fd(struct vdagent_virtio_port *vport);
+
+/* Read what is available from the port, handing complete messages to
+   callback instead of the read callback given to vdagent_virtio_port_create.
+   This never destroys the port, it returns -1 when the port was disconnected
+   or hit an error and must be destroyed, 1 when the host side has not opened
+   the port yet and the caller should wait a bit before polling the port
+   again, and 0 otherwise. */
+int vdagent_virtio_port_read(struct vdagent_virtio_port *vport,
+    vdagent_virtio_port_message_callback callback, void *user_data);
+
 void vdagent_virtio_port_flush(struct vdagent_virtio_port **vportp);
 void vdagent_virtio_port_reset(struct vdagent_virtio_port *vport, int port);
 
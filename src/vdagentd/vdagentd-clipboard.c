@@ -0,0 +1,537 @@
+/*  vdagentd-clipboard.c vdagentd clipboard bookkeeping code
+
+    Copyright 2026 The spice-vdagent contributors
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include "vdagentd-clipboard.h"
+#include "vdagentd-timer.h"
+
+struct vdagentd_clipboard_request {
+    int requester;
+    uint8_t selection;
+    char *type;
+    uint32_t id;
+    uint64_t start;
+    uint64_t deadline;
+    uint32_t generation;
+    uint32_t backlog;
+
+    struct vdagentd_clipboard_request *next;
+};
+
+enum {
+    RECORD_ANSWERED,
+    RECORD_CACHED,
+    RECORD_EXPIRED,
+};
+
+/* A finished transfer, times are in milliseconds since the request came in,
+   backlogs are the bytes queued ahead of the request / answer */
+struct vdagentd_clipboard_record {
+    uint64_t start;
+    int requester;
+    int result;
+    uint8_t selection;
+    char type[32];
+    uint32_t size;
+    uint32_t first_byte;
+    uint32_t last_byte;
+    uint32_t request_backlog;
+    uint32_t answer_backlog;
+};
+
+struct vdagentd_clipboard_cache_entry {
+    int requester;
+    uint8_t selection;
+    char *type;
+    uint8_t *data;
+    uint32_t size;
+
+    struct vdagentd_clipboard_cache_entry *next;
+};
+
+/* Last grab by the agent */
+struct vdagentd_clipboard_grab {
+    uint32_t owner;
+    uint32_t hash;
+    uint32_t size;
+    uint64_t time;
+};
+
+struct vdagentd_clipboard {
+    int debug;
+    vdagentd_clipboard_expire_callback expire_callback;
+    unsigned int grab_window;
+    struct vdagentd_clipboard_grab grab[256];
+
+    /* Outstanding requests, oldest (and thus first to expire) first */
+    struct vdagentd_clipboard_request *requests;
+    struct vdagentd_timer *timer;
+
+    /* Bumped on every grab / release, per selection */
+    uint32_t generation[256];
+    /* Cached answers, least recently added first */
+    struct vdagentd_clipboard_cache_entry *cache;
+    size_t cache_size;
+
+    /* Ring buffer of the last finished transfers */
+    struct vdagentd_clipboard_record log[VDAGENTD_CLIPBOARD_LOG_SIZE];
+    unsigned int log_next;
+    unsigned int log_count;
+};
+
+static void request_timeout(void *user_data);
+
+static const char *requester_to_string(int requester)
+{
+    return requester == VDAGENTD_CLIPBOARD_CLIENT ? "client" : "agent";
+}
+
+static struct vdagentd_clipboard_record *log_add(
+    struct vdagentd_clipboard *clipboard, int requester, uint8_t selection,
+    const char *type, int result)
+{
+    struct vdagentd_clipboard_record *rec;
+
+    rec = &clipboard->log[clipboard->log_next];
+    clipboard->log_next = (clipboard->log_next + 1) % VDAGENTD_CLIPBOARD_LOG_SIZE;
+    if (clipboard->log_count < VDAGENTD_CLIPBOARD_LOG_SIZE)
+        clipboard->log_count++;
+
+    memset(rec, 0, sizeof(*rec));
+    rec->start = vdagentd_timer_get_time();
+    rec->requester = requester;
+    rec->result = result;
+    rec->selection = selection;
+    strncpy(rec->type, type ? type : "", sizeof(rec->type) - 1);
+
+    return rec;
+}
+
+static void log_request(struct vdagentd_clipboard *clipboard,
+    struct vdagentd_clipboard_request *req, int result, uint32_t size,
+    uint64_t first_byte, uint32_t backlog)
+{
+    struct vdagentd_clipboard_record *rec;
+    uint64_t now = vdagentd_timer_get_time();
+
+    rec = log_add(clipboard, req->requester, req->selection, req->type,
+                  result);
+    rec->start = req->start;
+    rec->size = size;
+    if (first_byte)
+        rec->first_byte = first_byte > req->start ? first_byte - req->start : 0;
+    rec->last_byte = now - req->start;
+    rec->request_backlog = req->backlog;
+    rec->answer_backlog = backlog;
+}
+
+struct vdagentd_clipboard *vdagentd_clipboard_create(
+    vdagentd_clipboard_expire_callback expire_callback,
+    unsigned int grab_window, int debug)
+{
+    struct vdagentd_clipboard *clipboard;
+
+    clipboard = calloc(1, sizeof(*clipboard));
+    if (!clipboard)
+        return NULL;
+
+    clipboard->debug = debug;
+    clipboard->expire_callback = expire_callback;
+    clipboard->grab_window = grab_window;
+    clipboard->timer = vdagentd_timer_create(request_timeout, clipboard);
+    if (!clipboard->timer) {
+        free(clipboard);
+        return NULL;
+    }
+
+    return clipboard;
+}
+
+static void request_free(struct vdagentd_clipboard_request *req)
+{
+    free(req->type);
+    free(req);
+}
+
+static void cache_entry_free(struct vdagentd_clipboard *clipboard,
+    struct vdagentd_clipboard_cache_entry *entry)
+{
+    clipboard->cache_size -= entry->size;
+    free(entry->type);
+    free(entry->data);
+    free(entry);
+}
+
+/* Remove the entries matching selection (all if selection is -1), and type
+   (all if type is NULL) */
+static void cache_remove(struct vdagentd_clipboard *clipboard,
+    int requester, int selection, const char *type)
+{
+    struct vdagentd_clipboard_cache_entry *entry, **entryp;
+
+    entryp = &clipboard->cache;
+    while ((entry = *entryp)) {
+        if ((selection != -1 && (entry->requester != requester ||
+                                 entry->selection != selection)) ||
+                (type && strcmp(entry->type, type))) {
+            entryp = &entry->next;
+            continue;
+        }
+        *entryp = entry->next;
+        cache_entry_free(clipboard, entry);
+    }
+}
+
+static void cache_add(struct vdagentd_clipboard *clipboard,
+    int requester, uint8_t selection, const char *type,
+    const uint8_t *data, uint32_t size)
+{
+    struct vdagentd_clipboard_cache_entry *entry, **entryp;
+    uint32_t type_size = strlen(type) + 1;
+
+    /* Cache the complete message, the type name followed by the data */
+    if (size > VDAGENTD_CLIPBOARD_CACHE_SIZE - type_size)
+        return;
+    size += type_size;
+
+    cache_remove(clipboard, requester, selection, type);
+
+    entry = calloc(1, sizeof(*entry));
+    if (!entry)
+        return;
+    entry->type = strdup(type);
+    entry->data = malloc(size);
+    if (!entry->type || !entry->data) {
+        free(entry->type);
+        free(entry->data);
+        free(entry);
+        return;
+    }
+    memcpy(entry->data, type, type_size);
+    memcpy(entry->data + type_size, data, size - type_size);
+    entry->requester = requester;
+    entry->selection = selection;
+    entry->size = size;
+
+    /* Evict the oldest entries to make room */
+    while (clipboard->cache &&
+           clipboard->cache_size + size > VDAGENTD_CLIPBOARD_CACHE_SIZE) {
+        struct vdagentd_clipboard_cache_entry *oldest = clipboard->cache;
+        clipboard->cache = oldest->next;
+        cache_entry_free(clipboard, oldest);
+    }
+
+    entryp = &clipboard->cache;
+    while (*entryp)
+        entryp = &(*entryp)->next;
+    *entryp = entry;
+    clipboard->cache_size += size;
+}
+
+void vdagentd_clipboard_destroy(struct vdagentd_clipboard **clipboardp)
+{
+    struct vdagentd_clipboard *clipboard = *clipboardp;
+    struct vdagentd_clipboard_request *req, *next_req;
+
+    if (!clipboard)
+        return;
+
+    req = clipboard->requests;
+    while (req) {
+        next_req = req->next;
+        request_free(req);
+        req = next_req;
+    }
+
+    cache_remove(clipboard, 0, -1, NULL);
+    vdagentd_timer_destroy(&clipboard->timer);
+    free(clipboard);
+    *clipboardp = NULL;
+}
+
+int vdagentd_clipboard_request_add(struct vdagentd_clipboard *clipboard,
+    int requester, uint8_t selection, const char *type, uint32_t id,
+    uint32_t backlog)
+{
+    struct vdagentd_clipboard_request *req, **reqp;
+
+    req = calloc(1, sizeof(*req));
+    if (!req)
+        return -1;
+
+    req->type = strdup(type ? type : "");
+    if (!req->type) {
+        free(req);
+        return -1;
+    }
+    req->requester = requester;
+    req->selection = selection;
+    req->generation = clipboard->generation[selection];
+    req->id = id;
+    req->backlog = backlog;
+    req->start = vdagentd_timer_get_time();
+    req->deadline  = req->start + VDAGENTD_CLIPBOARD_REQUEST_TIMEOUT;
+
+    reqp = &clipboard->requests;
+    while (*reqp)
+        reqp = &(*reqp)->next;
+    *reqp = req;
+
+    if (!vdagentd_timer_is_active(clipboard->timer))
+        vdagentd_timer_start(clipboard->timer,
+                             VDAGENTD_CLIPBOARD_REQUEST_TIMEOUT, 0);
+
+    return 0;
+}
+
+int vdagentd_clipboard_request_done(struct vdagentd_clipboard *clipboard,
+    int requester, uint8_t selection, const char *type,
+    const uint8_t *data, uint32_t size,
+    uint64_t first_byte, uint32_t backlog, uint32_t *id)
+{
+    struct vdagentd_clipboard_request *req, **reqp, **match = NULL;
+    int has_data = type && size, pending = 0;
+
+    for (reqp = &clipboard->requests; (req = *reqp); reqp = &req->next) {
+        if (req->requester != requester || req->selection != selection)
+            continue;
+        pending = 1;
+        /* Data can only answer a request for its type, passing it on under
+           the id of another request would get it used as the wrong type */
+        if (!match && !has_data)
+            match = reqp;
+        if (type && !strcmp(req->type, type)) {
+            match = reqp;
+            break;
+        }
+    }
+
+    if (!match && pending) {
+        syslog(LOG_WARNING, "dropping clipboard data of type %s for the %s, "
+               "selection %u, which was not asked for", type,
+               requester_to_string(requester), selection);
+        return -1;
+    }
+    if (!match) {
+        if (clipboard->debug)
+            syslog(LOG_DEBUG, "unexpected clipboard data for the %s, "
+                   "selection %u, type %s", requester_to_string(requester),
+                   selection, type ? type : "none");
+        return -1;
+    }
+
+    req = *match;
+    *match = req->next;
+
+    /* Only cache non empty answers, for the current owner */
+    if (has_data && req->generation == clipboard->generation[selection])
+        cache_add(clipboard, requester, selection, type, data, size);
+
+    log_request(clipboard, req, RECORD_ANSWERED, size, first_byte, backlog);
+    *id = req->id;
+    request_free(req);
+
+    return 0;
+}
+
+int vdagentd_clipboard_cache_lookup(struct vdagentd_clipboard *clipboard,
+    int requester, uint8_t selection, const char *type,
+    const uint8_t **data, uint32_t *size)
+{
+    struct vdagentd_clipboard_cache_entry *entry;
+
+    if (!type)
+        return -1;
+
+    for (entry = clipboard->cache; entry; entry = entry->next) {
+        if (entry->requester == requester && entry->selection == selection &&
+                !strcmp(entry->type, type)) {
+            if (clipboard->debug)
+                syslog(LOG_DEBUG, "answering clipboard request from the %s "
+                       "for selection %u, type %s from cache",
+                       requester_to_string(requester), selection, type);
+            log_add(clipboard, requester, selection, type,
+                    RECORD_CACHED)->size = entry->size - strlen(type) - 1;
+            *data = entry->data;
+            *size = entry->size;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+void vdagentd_clipboard_invalidate(struct vdagentd_clipboard *clipboard,
+    uint8_t selection)
+{
+    if (!clipboard)
+        return;
+
+    clipboard->generation[selection]++;
+    cache_remove(clipboard, VDAGENTD_CLIPBOARD_CLIENT, selection, NULL);
+    cache_remove(clipboard, VDAGENTD_CLIPBOARD_AGENT, selection, NULL);
+}
+
+void vdagentd_clipboard_invalidate_all(struct vdagentd_clipboard *clipboard)
+{
+    int i;
+
+    if (!clipboard)
+        return;
+
+    for (i = 0; i < 256; i++)
+        clipboard->generation[i]++;
+    cache_remove(clipboard, 0, -1, NULL);
+}
+
+static void request_expire(struct vdagentd_clipboard *clipboard,
+    struct vdagentd_clipboard_request *req)
+{
+    if (clipboard->debug)
+        syslog(LOG_DEBUG, "clipboard request from the %s for selection %u, "
+               "type %s expired", requester_to_string(req->requester),
+               req->selection, req->type);
+
+    if (clipboard->expire_callback)
+        clipboard->expire_callback(req->requester, req->selection, req->type,
+                                   req->id);
+    log_request(clipboard, req, RECORD_EXPIRED, 0, 0, 0);
+    request_free(req);
+}
+
+void vdagentd_clipboard_request_cancel_all(
+    struct vdagentd_clipboard *clipboard, int requester)
+{
+    struct vdagentd_clipboard_request *req, **reqp;
+
+    if (!clipboard)
+        return;
+
+    reqp = &clipboard->requests;
+    while ((req = *reqp)) {
+        if (req->requester != requester) {
+            reqp = &req->next;
+            continue;
+        }
+        *reqp = req->next;
+        request_expire(clipboard, req);
+    }
+}
+
+static void request_timeout(void *user_data)
+{
+    struct vdagentd_clipboard *clipboard = user_data;
+    struct vdagentd_clipboard_request *req;
+    uint64_t now = vdagentd_timer_get_time();
+
+    /* All requests have the same timeout, so the oldest expires first */
+    while ((req = clipboard->requests) && req->deadline <= now) {
+        clipboard->requests = req->next;
+        request_expire(clipboard, req);
+    }
+
+    if (clipboard->requests)
+        vdagentd_timer_start(clipboard->timer,
+                             clipboard->requests->deadline - now, 0);
+}
+
+/* FNV-1a */
+static uint32_t hash_data(const uint8_t *data, uint32_t size)
+{
+    uint32_t i, hash = 2166136261u;
+
+    for (i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+int vdagentd_clipboard_grab_is_duplicate(struct vdagentd_clipboard *clipboard,
+    uint8_t selection, uint32_t owner, const uint8_t *types, uint32_t size)
+{
+    struct vdagentd_clipboard_grab *grab = &clipboard->grab[selection];
+    uint32_t hash = hash_data(types, size);
+    uint64_t now = vdagentd_timer_get_time();
+    int duplicate;
+
+    /* Without knowing the owner, this may be another app copying data with
+       the same types, which the client must hear about */
+    duplicate = grab->time && owner && grab->owner == owner &&
+                grab->hash == hash && grab->size == size &&
+                now - grab->time < clipboard->grab_window;
+    if (duplicate && clipboard->debug)
+        syslog(LOG_DEBUG, "ignoring identical grab of selection %u",
+               selection);
+
+    grab->owner = owner;
+    grab->hash = hash;
+    grab->size = size;
+    grab->time = now;
+
+    return duplicate;
+}
+
+void vdagentd_clipboard_forget_grab(struct vdagentd_clipboard *clipboard,
+    uint8_t selection)
+{
+    if (!clipboard)
+        return;
+
+    memset(&clipboard->grab[selection], 0, sizeof(clipboard->grab[0]));
+}
+
+void vdagentd_clipboard_log_dump(struct vdagentd_clipboard *clipboard)
+{
+    static const char * const result_to_string[] = {
+        [RECORD_ANSWERED] = "answered",
+        [RECORD_CACHED] = "cached",
+        [RECORD_EXPIRED] = "expired",
+    };
+    struct vdagentd_clipboard_record *rec;
+    uint64_t now = vdagentd_timer_get_time();
+    unsigned int i, idx;
+
+    if (!clipboard)
+        return;
+
+    syslog(LOG_INFO, "last %u clipboard transfers (times in ms, backlogs "
+           "in bytes queued ahead of the request / answer):",
+           clipboard->log_count);
+
+    idx = (clipboard->log_next + VDAGENTD_CLIPBOARD_LOG_SIZE -
+           clipboard->log_count) % VDAGENTD_CLIPBOARD_LOG_SIZE;
+    for (i = 0; i < clipboard->log_count; i++) {
+        rec = &clipboard->log[idx];
+        syslog(LOG_INFO, "  %llus ago: %s request, selection %u, type %s: "
+               "%s, size %u, first byte %u, last byte %u, "
+               "backlog %u / %u",
+               (unsigned long long)(now - rec->start) / 1000,
+               requester_to_string(rec->requester), rec->selection,
+               rec->type, result_to_string[rec->result], rec->size,
+               rec->first_byte, rec->last_byte,
+               rec->request_backlog, rec->answer_backlog);
+        idx = (idx + 1) % VDAGENTD_CLIPBOARD_LOG_SIZE;
+    }
+}
@@ -0,0 +1,127 @@
+/*  vdagentd-clipboard.h vdagentd clipboard bookkeeping header
+
+    Copyright 2026 The spice-vdagent contributors
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __VDAGENTD_CLIPBOARD_H
+#define __VDAGENTD_CLIPBOARD_H
+
+#include <stdint.h>
+
+/* Who sent a clipboard request, and thus is waiting for its answer */
+enum {
+    VDAGENTD_CLIPBOARD_CLIENT,
+    VDAGENTD_CLIPBOARD_AGENT,
+};
+
+/* Time after which a request which has not been answered gets answered
+   with empty data, in milliseconds */
+#define VDAGENTD_CLIPBOARD_REQUEST_TIMEOUT 30000
+
+/* Maximum amount of clipboard data cached for answering repeated requests */
+#define VDAGENTD_CLIPBOARD_CACHE_SIZE (16 * 1024 * 1024)
+
+/* Default time window in which an identical grab is not forwarded, in
+   milliseconds */
+#define VDAGENTD_CLIPBOARD_GRAB_WINDOW 1000
+
+/* Number of transfers kept in the transfer log */
+#define VDAGENTD_CLIPBOARD_LOG_SIZE 64
+
+struct vdagentd_clipboard;
+
+/* Callbacks with this type will be called for requests which will never get
+   answered by their peer, the callback must send an empty answer to the
+   requester, passing back the id of its request. */
+typedef void (*vdagentd_clipboard_expire_callback)(int requester,
+    uint8_t selection, const char *type, uint32_t id);
+
+/* Identical grabs which follow each other within grab_window milliseconds
+   are reported by vdagentd_clipboard_grab_is_duplicate, 0 disables this */
+struct vdagentd_clipboard *vdagentd_clipboard_create(
+    vdagentd_clipboard_expire_callback expire_callback,
+    unsigned int grab_window, int debug);
+void vdagentd_clipboard_destroy(struct vdagentd_clipboard **clipboardp);
+
+/* Record a request for type on selection from requester, which has been
+   forwarded to the peer behind backlog bytes of other queued messages. id is
+   the requester's id for the request (0 if it does not use ids), which must
+   be passed back with the answer.
+
+   Returns 0 on success -1 on error (only happens when malloc fails) */
+int vdagentd_clipboard_request_add(struct vdagentd_clipboard *clipboard,
+    int requester, uint8_t selection, const char *type, uint32_t id,
+    uint32_t backlog);
+
+/* Match an answer for requester to the oldest outstanding request for
+   selection and type, and forget about it. Empty answers (type may be NULL
+   for those) go to the oldest request for selection if none is for type.
+   If the selection has not changed owner since the request was made, a non
+   empty answer (the data of type, which is not included in data) is cached
+   for answering further requests for the same type.
+
+   first_byte is the time (see vdagentd_timer_get_time) at which the answer
+   started coming in, backlog the number of bytes queued ahead of it towards
+   the requester, these go into the transfer log.
+
+   Returns 0 and fills in id with the id of the request if a request was
+   found, -1 if the answer is unexpected (ie it comes too late, or is data
+   of a type nothing asked for) and must not be forwarded */
+int vdagentd_clipboard_request_done(struct vdagentd_clipboard *clipboard,
+    int requester, uint8_t selection, const char *type,
+    const uint8_t *data, uint32_t size,
+    uint64_t first_byte, uint32_t backlog, uint32_t *id);
+
+/* Look up the cached answer to a request from requester for type on
+   selection, this is a complete clipboard data message: the type name
+   followed by the data. The returned data stays valid until the next call to
+   any vdagentd_clipboard function.
+
+   Returns 0 and fills in data and size if found, -1 otherwise */
+int vdagentd_clipboard_cache_lookup(struct vdagentd_clipboard *clipboard,
+    int requester, uint8_t selection, const char *type,
+    const uint8_t **data, uint32_t *size);
+
+/* Forget cached data for selection, to be called whenever it gets grabbed
+   or released. Answers to requests made before this will not be cached. */
+void vdagentd_clipboard_invalidate(struct vdagentd_clipboard *clipboard,
+    uint8_t selection);
+void vdagentd_clipboard_invalidate_all(struct vdagentd_clipboard *clipboard);
+
+/* Remember a grab of selection by the agent with the given list of types,
+   on behalf of owner (the X window owning the selection, 0 if unknown).
+
+   Returns 1 if it is identical to the previous grab by the agent, including
+   its owner, which happened less than the grab window ago, so that it does
+   not need to be forwarded to the client, 0 otherwise */
+int vdagentd_clipboard_grab_is_duplicate(struct vdagentd_clipboard *clipboard,
+    uint8_t selection, uint32_t owner, const uint8_t *types, uint32_t size);
+
+/* Forget the last grab of selection by the agent, to be called when
+   the selection gets released, or grabbed by the client */
+void vdagentd_clipboard_forget_grab(struct vdagentd_clipboard *clipboard,
+    uint8_t selection);
+
+/* Expire all requests from requester, without waiting for their deadline,
+   ie because the peer which should answer them is gone */
+void vdagentd_clipboard_request_cancel_all(
+    struct vdagentd_clipboard *clipboard, int requester);
+
+/* Write the last VDAGENTD_CLIPBOARD_LOG_SIZE transfers (answered, answered
+   from the cache or expired requests) to syslog, oldest first, with their
+   timings */
+void vdagentd_clipboard_log_dump(struct vdagentd_clipboard *clipboard);
+
+#endif
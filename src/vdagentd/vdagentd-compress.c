@@ -0,0 +1,432 @@
+/*  vdagentd-compress.c vdagentd clipboard compression code
+
+    Copyright 2026 The spice-vdagent contributors
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#include "vdagent-virtio-port.h"
+#include "vdagentd-compress.h"
+
+/* lz4 can't do better than this, anything claiming more is corrupt */
+#define MAX_RATIO 255
+
+#define MAX_PREFIX_SIZE 4
+
+enum {
+    STATE_PREFIX,
+    STATE_HEADER,
+    STATE_DATA,
+    STATE_BLOCK_HEADER,
+    STATE_BLOCK,
+    STATE_ERROR,
+};
+
+struct vdagentd_decompress {
+    uint32_t size;       /* size of the message data */
+    int max_size;
+    int state;
+
+    uint8_t prefix[MAX_PREFIX_SIZE];
+    uint32_t prefix_size;
+    uint32_t prefix_pos;
+
+    /* The header being read, either the message or a block header */
+    uint8_t header[VDAGENTD_COMPRESS_HEADER_SIZE];
+    uint32_t header_pos;
+
+    /* The decoded data, after a copy of the prefix */
+    uint8_t *out;
+    uint32_t out_size;
+    uint32_t out_pos;
+
+    /* The block being read, compressed blocks get gathered in block */
+    uint32_t block_raw_size;
+    uint32_t block_size;
+    uint32_t block_pos;
+    uint8_t *block;
+};
+
+static void put_le32(uint8_t *buf, uint32_t val)
+{
+    buf[0] = val;
+    buf[1] = val >> 8;
+    buf[2] = val >> 16;
+    buf[3] = val >> 24;
+}
+
+static uint32_t get_le32(const uint8_t *buf)
+{
+    return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+int vdagentd_compress_capability(void)
+{
+#ifdef HAVE_LZ4
+    return VDAGENTD_CAP_CLIPBOARD_LZ4;
+#else
+    return -1;
+#endif
+}
+
+static uint32_t vdagentd_compress_blocks(uint32_t size)
+{
+    return (size + VDAGENTD_COMPRESS_BLOCK_SIZE - 1) /
+           VDAGENTD_COMPRESS_BLOCK_SIZE;
+}
+
+uint32_t vdagentd_compress_bound(uint32_t prefix_size, uint32_t size)
+{
+    uint32_t blocks;
+
+    if (prefix_size + size == 0)
+        return 0;
+
+    blocks = vdagentd_compress_blocks(prefix_size) +
+             vdagentd_compress_blocks(size);
+    return VDAGENTD_COMPRESS_HEADER_SIZE + prefix_size + size +
+           blocks * VDAGENTD_COMPRESS_BLOCK_HEADER_SIZE;
+}
+
+/* Encode data as blocks at out, returns the end of the encoded data */
+static uint8_t *vdagentd_compress_blocks_write(uint8_t *out,
+    const uint8_t *data, uint32_t size)
+{
+    uint32_t pos, block;
+    int n;
+
+    for (pos = 0; pos < size; pos += block) {
+        block = size - pos;
+        if (block > VDAGENTD_COMPRESS_BLOCK_SIZE)
+            block = VDAGENTD_COMPRESS_BLOCK_SIZE;
+
+        /* Only keep the compressed block if it is smaller */
+#ifdef HAVE_LZ4
+        n = LZ4_compress_default((const char *)data + pos,
+                                 (char *)out +
+                                     VDAGENTD_COMPRESS_BLOCK_HEADER_SIZE,
+                                 block, block - 1);
+#else
+        n = 0;
+#endif
+        if (n <= 0) {
+            memcpy(out + VDAGENTD_COMPRESS_BLOCK_HEADER_SIZE, data + pos,
+                   block);
+            n = block;
+        }
+
+        put_le32(out, block);
+        put_le32(out + 4, n);
+        out += VDAGENTD_COMPRESS_BLOCK_HEADER_SIZE + n;
+    }
+
+    return out;
+}
+
+int vdagentd_compress_write(struct vdagent_virtio_port *vport,
+    const uint8_t *prefix, uint32_t prefix_size,
+    const uint8_t *data, uint32_t size)
+{
+    uint8_t *buf, *out;
+    uint32_t avail;
+
+    if (prefix_size + size == 0)
+        return vdagent_virtio_port_write_end(vport, 0);
+
+    buf = vdagent_virtio_port_write_buffer(vport, &avail);
+    if (!buf || avail < vdagentd_compress_bound(prefix_size, size)) {
+        syslog(LOG_ERR, "no room for compressing clipboard data");
+        return -1;
+    }
+
+    out = buf + VDAGENTD_COMPRESS_HEADER_SIZE;
+    put_le32(buf + 4, prefix_size + size);
+
+    if (prefix_size + size < VDAGENTD_COMPRESS_MIN_SIZE) {
+        put_le32(buf, VDAGENTD_COMPRESS_NONE);
+        if (prefix_size)
+            memcpy(out, prefix, prefix_size);
+        if (size)
+            memcpy(out + prefix_size, data, size);
+        out += prefix_size + size;
+    } else {
+        put_le32(buf, VDAGENTD_COMPRESS_LZ4);
+        out = vdagentd_compress_blocks_write(out, prefix, prefix_size);
+        out = vdagentd_compress_blocks_write(out, data, size);
+    }
+
+    return vdagent_virtio_port_write_end(vport, out - buf);
+}
+
+struct vdagentd_decompress *vdagentd_decompress_create(uint32_t prefix_size,
+    uint32_t size, int max_size)
+{
+    struct vdagentd_decompress *dec;
+
+    if (prefix_size > MAX_PREFIX_SIZE)
+        return NULL;
+
+    dec = calloc(1, sizeof(*dec));
+    if (!dec) {
+        syslog(LOG_ERR, "out of memory allocating clipboard decompressor");
+        return NULL;
+    }
+
+    dec->size = size;
+    dec->max_size = max_size;
+    dec->prefix_size = prefix_size;
+    dec->state = prefix_size ? STATE_PREFIX : STATE_HEADER;
+
+    return dec;
+}
+
+static void vdagentd_decompress_error(struct vdagentd_decompress *dec,
+    const char *msg)
+{
+    syslog(LOG_ERR, "compressed clipboard data: %s", msg);
+    free(dec->out);
+    dec->out = NULL;
+    free(dec->block);
+    dec->block = NULL;
+    dec->state = STATE_ERROR;
+}
+
+/* Copy up to size bytes of data into the header, returns how much was used */
+static uint32_t vdagentd_decompress_gather_header(
+    struct vdagentd_decompress *dec, const uint8_t *data, uint32_t size)
+{
+    uint32_t n = sizeof(dec->header) - dec->header_pos;
+
+    if (n > size)
+        n = size;
+    memcpy(dec->header + dec->header_pos, data, n);
+    dec->header_pos += n;
+
+    return n;
+}
+
+static void vdagentd_decompress_header(struct vdagentd_decompress *dec)
+{
+    uint32_t codec = get_le32(dec->header);
+    uint32_t raw_size = get_le32(dec->header + 4);
+    uint32_t wire_size = dec->size - dec->prefix_size -
+                         VDAGENTD_COMPRESS_HEADER_SIZE;
+
+    dec->header_pos = 0;
+
+    if ((dec->max_size != -1 && raw_size > (uint32_t)dec->max_size) ||
+            raw_size > UINT32_MAX - dec->prefix_size) {
+        vdagentd_decompress_error(dec, "too large");
+        return;
+    }
+
+    switch (codec) {
+    case VDAGENTD_COMPRESS_NONE:
+        if (raw_size != wire_size) {
+            vdagentd_decompress_error(dec, "bad size");
+            return;
+        }
+        dec->state = STATE_DATA;
+        break;
+    case VDAGENTD_COMPRESS_LZ4:
+        if (raw_size / MAX_RATIO > wire_size) {
+            vdagentd_decompress_error(dec, "bad size");
+            return;
+        }
+        dec->state = STATE_BLOCK_HEADER;
+        break;
+    default:
+        vdagentd_decompress_error(dec, "unknown codec");
+        return;
+    }
+
+    dec->out_size = dec->prefix_size + raw_size;
+    if (dec->out_size == 0)
+        return;
+    dec->out = malloc(dec->out_size);
+    if (!dec->out) {
+        vdagentd_decompress_error(dec, "out of memory");
+        return;
+    }
+    memcpy(dec->out, dec->prefix, dec->prefix_size);
+    dec->out_pos = dec->prefix_size;
+}
+
+static void vdagentd_decompress_block_header(struct vdagentd_decompress *dec)
+{
+    dec->block_raw_size = get_le32(dec->header);
+    dec->block_size = get_le32(dec->header + 4);
+    dec->block_pos = 0;
+    dec->header_pos = 0;
+
+    if (dec->block_raw_size == 0 ||
+            dec->block_raw_size > VDAGENTD_COMPRESS_BLOCK_SIZE ||
+            dec->block_raw_size > dec->out_size - dec->out_pos ||
+            dec->block_size == 0 || dec->block_size > dec->block_raw_size) {
+        vdagentd_decompress_error(dec, "bad block size");
+        return;
+    }
+
+    if (dec->block_size < dec->block_raw_size && !dec->block) {
+        dec->block = malloc(VDAGENTD_COMPRESS_BLOCK_SIZE);
+        if (!dec->block) {
+            vdagentd_decompress_error(dec, "out of memory");
+            return;
+        }
+    }
+
+    dec->state = STATE_BLOCK;
+}
+
+static void vdagentd_decompress_block(struct vdagentd_decompress *dec)
+{
+    int n = -1;
+
+    if (dec->block_size < dec->block_raw_size) {
+#ifdef HAVE_LZ4
+        n = LZ4_decompress_safe((const char *)dec->block,
+                                (char *)dec->out + dec->out_pos,
+                                dec->block_size, dec->block_raw_size);
+#endif
+        if (n != dec->block_raw_size) {
+            vdagentd_decompress_error(dec, "corrupt block");
+            return;
+        }
+    }
+
+    dec->out_pos += dec->block_raw_size;
+    dec->state = STATE_BLOCK_HEADER;
+}
+
+void vdagentd_decompress_feed(struct vdagentd_decompress *dec,
+    const uint8_t *data, uint32_t size)
+{
+    uint32_t n;
+
+    while (size && dec->state != STATE_ERROR) {
+        switch (dec->state) {
+        case STATE_PREFIX:
+            n = dec->prefix_size - dec->prefix_pos;
+            if (n > size)
+                n = size;
+            memcpy(dec->prefix + dec->prefix_pos, data, n);
+            dec->prefix_pos += n;
+            if (dec->prefix_pos == dec->prefix_size)
+                dec->state = STATE_HEADER;
+            break;
+        case STATE_HEADER:
+            n = vdagentd_decompress_gather_header(dec, data, size);
+            if (dec->header_pos == VDAGENTD_COMPRESS_HEADER_SIZE)
+                vdagentd_decompress_header(dec);
+            break;
+        case STATE_DATA:
+            n = dec->out_size - dec->out_pos;
+            if (n == 0) {
+                vdagentd_decompress_error(dec, "trailing data");
+                return;
+            }
+            if (n > size)
+                n = size;
+            memcpy(dec->out + dec->out_pos, data, n);
+            dec->out_pos += n;
+            break;
+        case STATE_BLOCK_HEADER:
+            n = vdagentd_decompress_gather_header(dec, data, size);
+            if (dec->header_pos == VDAGENTD_COMPRESS_BLOCK_HEADER_SIZE)
+                vdagentd_decompress_block_header(dec);
+            break;
+        case STATE_BLOCK:
+            n = dec->block_size - dec->block_pos;
+            if (n > size)
+                n = size;
+            /* Stored blocks go straight to the output */
+            if (dec->block_size == dec->block_raw_size)
+                memcpy(dec->out + dec->out_pos + dec->block_pos, data, n);
+            else
+                memcpy(dec->block + dec->block_pos, data, n);
+            dec->block_pos += n;
+            if (dec->block_pos == dec->block_size)
+                vdagentd_decompress_block(dec);
+            break;
+        default:
+            return;
+        }
+        data += n;
+        size -= n;
+    }
+}
+
+uint8_t *vdagentd_decompress_finish(struct vdagentd_decompress **decp,
+    uint32_t *size)
+{
+    struct vdagentd_decompress *dec = *decp;
+    uint8_t *buf = NULL;
+
+    switch (dec->state) {
+    case STATE_PREFIX:
+    case STATE_HEADER:
+        /* Empty data has no header */
+        if (dec->header_pos)
+            vdagentd_decompress_error(dec, "truncated");
+        break;
+    case STATE_DATA:
+    case STATE_BLOCK_HEADER:
+        if (dec->out_pos != dec->out_size || dec->header_pos)
+            vdagentd_decompress_error(dec, "truncated");
+        break;
+    case STATE_BLOCK:
+        vdagentd_decompress_error(dec, "truncated");
+        break;
+    }
+
+    if (dec->out) {
+        buf = dec->out;
+        *size = dec->out_size;
+        dec->out = NULL;
+    } else {
+        *size = dec->prefix_pos;
+        if (*size) {
+            buf = malloc(*size);
+            if (buf)
+                memcpy(buf, dec->prefix, *size);
+            else
+                *size = 0;
+        }
+    }
+
+    vdagentd_decompress_destroy(decp);
+    return buf;
+}
+
+void vdagentd_decompress_destroy(struct vdagentd_decompress **decp)
+{
+    struct vdagentd_decompress *dec = *decp;
+
+    if (!dec)
+        return;
+
+    free(dec->out);
+    free(dec->block);
+    free(dec);
+    *decp = NULL;
+}
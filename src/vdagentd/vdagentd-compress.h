@@ -0,0 +1,106 @@
+/*  vdagentd-compress.h vdagentd clipboard compression header
+
+    Copyright 2026 The spice-vdagent contributors
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __VDAGENTD_COMPRESS_H
+#define __VDAGENTD_COMPRESS_H
+
+#include <stdint.h>
+#include <spice/vd_agent.h>
+
+/* When both sides announce VDAGENTD_CAP_CLIPBOARD_LZ4, the data of every
+   non-empty VD_AGENT_CLIPBOARD message (after the selection, if any) starts
+   with a header of 2 little endian uint32_t: the codec and the size of the
+   data once decoded.
+
+   With VDAGENTD_COMPRESS_NONE the data follows as is. With
+   VDAGENTD_COMPRESS_LZ4 it follows as blocks of at most
+   VDAGENTD_COMPRESS_BLOCK_SIZE bytes, each starting with a header of 2 little
+   endian uint32_t: the size of the block once decoded and its size on the
+   wire. Blocks with both sizes equal are stored as is, the others are
+   independent lz4 blocks, so neither side ever needs more than one block of
+   state besides the data itself. */
+/* spice-protocol does not define the capability yet, until it does a bit
+   well past the ones it defines is used (not bit 31 of a word, which the
+   spice-protocol macros shift into the sign bit). Capability arrays
+   announced by vdagentd must have VDAGENTD_CAPS_SIZE elements to have room
+   for it. */
+#ifdef HAVE_VD_AGENT_CAP_CLIPBOARD_LZ4
+#define VDAGENTD_CAP_CLIPBOARD_LZ4 VD_AGENT_CAP_CLIPBOARD_LZ4
+#else
+#define VDAGENTD_CAP_CLIPBOARD_LZ4 48
+#endif
+#define VDAGENTD_CAPS_SIZE \
+    (VD_AGENT_CAPS_SIZE > VDAGENTD_CAP_CLIPBOARD_LZ4 / 32 + 1 ? \
+     VD_AGENT_CAPS_SIZE : VDAGENTD_CAP_CLIPBOARD_LZ4 / 32 + 1)
+
+#define VDAGENTD_COMPRESS_NONE 0
+#define VDAGENTD_COMPRESS_LZ4 1
+
+#define VDAGENTD_COMPRESS_HEADER_SIZE 8
+#define VDAGENTD_COMPRESS_BLOCK_HEADER_SIZE 8
+#define VDAGENTD_COMPRESS_BLOCK_SIZE (64 * 1024)
+
+/* Clipboard data smaller than this is sent with VDAGENTD_COMPRESS_NONE */
+#define VDAGENTD_COMPRESS_MIN_SIZE 1024
+
+struct vdagent_virtio_port;
+struct vdagentd_decompress;
+
+/* Return the capability bit announcing compression support, or -1 if
+   vdagentd was built without compression support */
+int vdagentd_compress_capability(void);
+
+/* Return the maximum size prefix_size bytes of prefix followed by size bytes
+   of data can take once encoded */
+uint32_t vdagentd_compress_bound(uint32_t prefix_size, uint32_t size);
+
+/* Encode prefix_size bytes of prefix followed by size bytes of data straight
+   into the message last queued on vport with vdagent_virtio_port_write_start,
+   which must have room for vdagentd_compress_bound(prefix_size, size) more
+   bytes. The message is then ended (and shrunk to what the encoded data took
+   up). The prefix gets its own block, so it need not be contiguous with the
+   data.
+
+   Returns 0 on success -1 on error */
+int vdagentd_compress_write(struct vdagent_virtio_port *vport,
+    const uint8_t *prefix, uint32_t prefix_size,
+    const uint8_t *data, uint32_t size);
+
+/* Create a decoder for the data of a message of size bytes, of which the
+   first prefix_size bytes (at most 4) are passed on as is. Decoded data
+   larger than max_size bytes (unless max_size is -1) is rejected.
+
+   Returns NULL when out of memory or built without compression support */
+struct vdagentd_decompress *vdagentd_decompress_create(uint32_t prefix_size,
+    uint32_t size, int max_size);
+
+/* Feed the next size bytes of the message to the decoder */
+void vdagentd_decompress_feed(struct vdagentd_decompress *dec,
+    const uint8_t *data, uint32_t size);
+
+/* Destroy the decoder, returning the prefix followed by the decoded data,
+   which must be free-ed by the caller, and its size in size. If the data was
+   corrupt or too large only the prefix is returned. NULL is returned when
+   this is empty (or when out of memory). The contents of decp will be made
+   NULL */
+uint8_t *vdagentd_decompress_finish(struct vdagentd_decompress **decp,
+    uint32_t *size);
+
+/* The contents of decp will be made NULL */
+void vdagentd_decompress_destroy(struct vdagentd_decompress **decp);
+
+#endif
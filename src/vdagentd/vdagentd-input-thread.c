@@ -0,0 +1,332 @@
+/*  vdagentd-input-thread.c vdagentd virtio port reader thread
+
+    Copyright 2026 The spice-vdagent contributors
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include "vdagentd-input-thread.h"
+
+/* Must be a power of 2 */
+#define QUEUE_SIZE 256
+
+/* How long to wait for the host side to open the port, or for the main loop
+   to make room in the queue, before checking again (in milliseconds) */
+#define RETRY_DELAY 10
+
+struct vdagentd_input_thread_msg {
+    int port_nr;
+    uint64_t message_start;
+    VDAgentMessage header;
+    uint8_t data[];
+};
+
+struct vdagentd_input_thread {
+    struct vdagent_virtio_port *vport;
+    vdagentd_input_thread_filter filter;
+    vdagent_virtio_port_read_callback read_callback;
+    int priority;
+    pthread_t thread;
+
+    int wakeup_pipe[2]; /* input thread -> main loop */
+    int stop_pipe[2];   /* main loop -> input thread */
+    int failed;         /* set by the input thread before it exits */
+
+    /* Single producer (the input thread), single consumer (the main loop)
+       ring buffer. head is only written by the producer and tail only by
+       the consumer, so this needs no locking. */
+    unsigned int head;
+    unsigned int tail;
+    struct vdagentd_input_thread_msg *queue[QUEUE_SIZE];
+
+    /* Start time of the message being handed to the read callback */
+    uint64_t message_start;
+};
+
+/* Wait up to timeout milliseconds for the main loop to ask us to stop,
+   returns 1 if it did */
+static int vdagentd_input_thread_wait_stop(
+    struct vdagentd_input_thread *thread, int timeout)
+{
+    struct pollfd pfd;
+
+    pfd.fd = thread->stop_pipe[0];
+    pfd.events = POLLIN;
+    return poll(&pfd, 1, timeout) == 1;
+}
+
+static int vdagentd_input_thread_push(struct vdagentd_input_thread *thread,
+    struct vdagentd_input_thread_msg *msg)
+{
+    unsigned int head = thread->head;
+
+    /* When the main loop gets behind, stop reading from the port until it
+       catches up, rather than dropping messages */
+    while (head - __atomic_load_n(&thread->tail, __ATOMIC_ACQUIRE) ==
+            QUEUE_SIZE) {
+        if (vdagentd_input_thread_wait_stop(thread, RETRY_DELAY))
+            return -1;
+    }
+
+    thread->queue[head % QUEUE_SIZE] = msg;
+    __atomic_store_n(&thread->head, head + 1, __ATOMIC_RELEASE);
+
+    /* If the pipe is full the main loop has a wakeup pending already */
+    if (write(thread->wakeup_pipe[1], "", 1) == -1 && errno != EAGAIN)
+        syslog(LOG_ERR, "waking up main loop: %m");
+
+    return 0;
+}
+
+static int vdagentd_input_thread_message(void *user_data, int port_nr,
+    VDAgentMessage *message_header, uint8_t *data, uint64_t message_start)
+{
+    struct vdagentd_input_thread *thread = user_data;
+    struct vdagentd_input_thread_msg *msg;
+
+    if (!thread->filter(thread->vport, port_nr, message_header, data,
+                        message_start))
+        return 0;
+
+    msg = malloc(sizeof(*msg) + message_header->size);
+    if (!msg) {
+        syslog(LOG_ERR, "out of memory queueing virtio message");
+        return -1;
+    }
+    msg->port_nr = port_nr;
+    msg->message_start = message_start;
+    msg->header = *message_header;
+    memcpy(msg->data, data, message_header->size);
+
+    if (vdagentd_input_thread_push(thread, msg)) {
+        free(msg);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void *vdagentd_input_thread_run(void *data)
+{
+    struct vdagentd_input_thread *thread = data;
+    struct sched_param param;
+    struct pollfd pfds[2];
+    int r, opening = 0;
+
+    if (thread->priority > 0) {
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = thread->priority;
+        r = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (r)
+            syslog(LOG_WARNING, "setting input thread priority to %d: %s",
+                   thread->priority, strerror(r));
+    }
+
+    pfds[0].fd = thread->stop_pipe[0];
+    pfds[0].events = POLLIN;
+    pfds[1].fd = vdagent_virtio_port_get_fd(thread->vport);
+    pfds[1].events = POLLIN;
+
+    for (;;) {
+        /* While the host side has not opened the port, reads return 0
+           immediately, so only wait for a stop request for a bit */
+        r = poll(pfds, opening ? 1 : 2, opening ? RETRY_DELAY : -1);
+        if (r == -1) {
+            if (errno == EINTR)
+                continue;
+            syslog(LOG_ERR, "input thread poll: %m");
+            break;
+        }
+        if (pfds[0].revents)
+            return NULL;
+        if (opening) {
+            opening = 0;
+            continue;
+        }
+        if (!pfds[1].revents)
+            continue;
+
+        r = vdagent_virtio_port_read(thread->vport,
+                                     vdagentd_input_thread_message, thread);
+        if (r == 1)
+            opening = 1;
+        else if (r == -1)
+            break;
+    }
+
+    __atomic_store_n(&thread->failed, 1, __ATOMIC_RELEASE);
+    if (write(thread->wakeup_pipe[1], "", 1) == -1 && errno != EAGAIN)
+        syslog(LOG_ERR, "waking up main loop: %m");
+
+    return NULL;
+}
+
+static int vdagentd_input_thread_pipe(int fds[2])
+{
+    if (pipe(fds) == -1)
+        return -1;
+
+    if (fcntl(fds[0], F_SETFL, O_NONBLOCK) == -1 ||
+            fcntl(fds[1], F_SETFL, O_NONBLOCK) == -1) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    return 0;
+}
+
+struct vdagentd_input_thread *vdagentd_input_thread_create(
+    struct vdagent_virtio_port *vport,
+    vdagentd_input_thread_filter filter,
+    vdagent_virtio_port_read_callback read_callback,
+    int priority)
+{
+    struct vdagentd_input_thread *thread;
+    sigset_t all, old;
+    int r;
+
+    thread = calloc(1, sizeof(*thread));
+    if (!thread)
+        return NULL;
+
+    thread->vport = vport;
+    thread->filter = filter;
+    thread->read_callback = read_callback;
+    thread->priority = priority;
+
+    if (vdagentd_input_thread_pipe(thread->wakeup_pipe)) {
+        syslog(LOG_ERR, "creating input thread wakeup pipe: %m");
+        free(thread);
+        return NULL;
+    }
+    if (vdagentd_input_thread_pipe(thread->stop_pipe)) {
+        syslog(LOG_ERR, "creating input thread stop pipe: %m");
+        close(thread->wakeup_pipe[0]);
+        close(thread->wakeup_pipe[1]);
+        free(thread);
+        return NULL;
+    }
+
+    vdagent_virtio_port_set_external_read(vport, 1);
+
+    /* Signals must keep interrupting the select() in the main loop */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    r = pthread_create(&thread->thread, NULL, vdagentd_input_thread_run,
+                       thread);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (r) {
+        syslog(LOG_ERR, "creating input thread: %s", strerror(r));
+        vdagent_virtio_port_set_external_read(vport, 0);
+        close(thread->stop_pipe[0]);
+        close(thread->stop_pipe[1]);
+        close(thread->wakeup_pipe[0]);
+        close(thread->wakeup_pipe[1]);
+        free(thread);
+        return NULL;
+    }
+
+    return thread;
+}
+
+void vdagentd_input_thread_destroy(struct vdagentd_input_thread **threadp)
+{
+    struct vdagentd_input_thread *thread = *threadp;
+
+    if (!thread)
+        return;
+
+    if (write(thread->stop_pipe[1], "", 1) == -1)
+        syslog(LOG_ERR, "stopping input thread: %m");
+    pthread_join(thread->thread, NULL);
+
+    while (thread->tail != thread->head) {
+        free(thread->queue[thread->tail % QUEUE_SIZE]);
+        thread->tail++;
+    }
+
+    vdagent_virtio_port_set_external_read(thread->vport, 0);
+    close(thread->stop_pipe[0]);
+    close(thread->stop_pipe[1]);
+    close(thread->wakeup_pipe[0]);
+    close(thread->wakeup_pipe[1]);
+    free(thread);
+    *threadp = NULL;
+}
+
+int vdagentd_input_thread_fill_fds(struct vdagentd_input_thread *thread,
+        fd_set *readfds)
+{
+    if (!thread)
+        return -1;
+
+    FD_SET(thread->wakeup_pipe[0], readfds);
+
+    return thread->wakeup_pipe[0] + 1;
+}
+
+int vdagentd_input_thread_handle_fds(struct vdagentd_input_thread *thread,
+        fd_set *readfds)
+{
+    struct vdagentd_input_thread_msg *msg;
+    unsigned int head;
+    uint8_t buf[64];
+    int failed, r;
+
+    if (!thread || !FD_ISSET(thread->wakeup_pipe[0], readfds))
+        return 0;
+
+    while (read(thread->wakeup_pipe[0], buf, sizeof(buf)) > 0)
+        ;
+
+    /* Check this first, everything queued before the thread failed must
+       still get handled */
+    failed = __atomic_load_n(&thread->failed, __ATOMIC_ACQUIRE);
+    head = __atomic_load_n(&thread->head, __ATOMIC_ACQUIRE);
+
+    while (thread->tail != head) {
+        msg = thread->queue[thread->tail % QUEUE_SIZE];
+        __atomic_store_n(&thread->tail, thread->tail + 1, __ATOMIC_RELEASE);
+
+        thread->message_start = msg->message_start;
+        r = thread->read_callback(thread->vport, msg->port_nr, &msg->header,
+                                  msg->data);
+        free(msg);
+        if (r == -1)
+            return -1;
+    }
+
+    return failed ? -1 : 0;
+}
+
+uint64_t vdagentd_input_thread_get_message_start_us(
+        struct vdagentd_input_thread *thread)
+{
+    return thread->message_start;
+}
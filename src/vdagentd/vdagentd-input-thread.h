@@ -0,0 +1,72 @@
+/*  vdagentd-input-thread.h vdagentd virtio port reader thread header
+
+    Copyright 2026 The spice-vdagent contributors
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __VDAGENTD_INPUT_THREAD_H
+#define __VDAGENTD_INPUT_THREAD_H
+
+#include <stdint.h>
+#include <sys/select.h>
+#include "vdagent-virtio-port.h"
+
+struct vdagentd_input_thread;
+
+/* Called on the input thread for every message read from the port. Messages
+   for which this returns 1 get queued and are handed to the read callback
+   of the input thread from vdagentd_input_thread_handle_fds, return 0 for
+   messages which have been fully handled on the input thread. */
+typedef int (*vdagentd_input_thread_filter)(
+    struct vdagent_virtio_port *vport,
+    int port_nr,
+    VDAgentMessage *message_header,
+    uint8_t *data,
+    uint64_t message_start);
+
+/* Start a thread reading vport, this makes the main loop stop reading vport
+   (see vdagent_virtio_port_set_external_read). If priority is > 0 the thread
+   tries to run with the SCHED_FIFO scheduling policy at this priority.
+
+   The thread must be destroyed before vport is destroyed. */
+struct vdagentd_input_thread *vdagentd_input_thread_create(
+    struct vdagent_virtio_port *vport,
+    vdagentd_input_thread_filter filter,
+    vdagent_virtio_port_read_callback read_callback,
+    int priority);
+
+/* Stop and join the thread, messages which are still queued are dropped.
+   The contents of threadp will be made NULL */
+void vdagentd_input_thread_destroy(struct vdagentd_input_thread **threadp);
+
+/* Add the fd the thread uses to wake up the main loop to readfds
+
+   Return value: value of the highest fd + 1 */
+int vdagentd_input_thread_fill_fds(struct vdagentd_input_thread *thread,
+        fd_set *readfds);
+
+/* Hand the queued messages to the read callback.
+
+   Returns -1 when the port got disconnected (or the read callback returned
+   -1) and must be destroyed, 0 otherwise */
+int vdagentd_input_thread_handle_fds(struct vdagentd_input_thread *thread,
+        fd_set *readfds);
+
+/* For use from the read callback: return the time (in microseconds, see
+   vdagentd_timer_get_time_us) at which the first chunk of the message being
+   handled was read */
+uint64_t vdagentd_input_thread_get_message_start_us(
+        struct vdagentd_input_thread *thread);
+
+#endif
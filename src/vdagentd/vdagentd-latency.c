@@ -0,0 +1,130 @@
+/*  vdagentd-latency.c vdagentd mouse latency statistics code
+
+    Copyright 2026 The spice-vdagent contributors
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include "vdagentd-latency.h"
+
+enum {
+    STAGE_QUEUE,  /* read -> dispatch */
+    STAGE_INJECT, /* dispatch -> written */
+    STAGE_TOTAL,  /* read -> written */
+    STAGE_COUNT
+};
+
+struct histogram {
+    uint32_t buckets[VDAGENTD_LATENCY_BUCKETS];
+    uint64_t sum;
+    uint64_t max;
+};
+
+struct vdagentd_latency {
+    uint32_t results[VDAGENTD_LATENCY_DROPPED + 1];
+    struct histogram stages[STAGE_COUNT];
+};
+
+static void histogram_add(struct histogram *hist, uint64_t usec)
+{
+    unsigned int bucket = 0;
+
+    while (bucket < VDAGENTD_LATENCY_BUCKETS - 1 && usec >> bucket)
+        bucket++;
+
+    hist->buckets[bucket]++;
+    hist->sum += usec;
+    if (usec > hist->max)
+        hist->max = usec;
+}
+
+struct vdagentd_latency *vdagentd_latency_create(void)
+{
+    return calloc(1, sizeof(struct vdagentd_latency));
+}
+
+void vdagentd_latency_destroy(struct vdagentd_latency **latencyp)
+{
+    free(*latencyp);
+    *latencyp = NULL;
+}
+
+void vdagentd_latency_add(struct vdagentd_latency *latency, int result,
+    uint64_t read, uint64_t dispatch, uint64_t written)
+{
+    if (!latency)
+        return;
+
+    latency->results[result]++;
+    if (result != VDAGENTD_LATENCY_WRITTEN)
+        return;
+
+    /* read is 0 when the message did not come from the virtio port */
+    if (read && read <= dispatch) {
+        histogram_add(&latency->stages[STAGE_QUEUE], dispatch - read);
+        histogram_add(&latency->stages[STAGE_TOTAL], written - read);
+    }
+    histogram_add(&latency->stages[STAGE_INJECT], written - dispatch);
+}
+
+void vdagentd_latency_dump(struct vdagentd_latency *latency)
+{
+    static const char * const stage_to_string[] = {
+        [STAGE_QUEUE] = "read to dispatch",
+        [STAGE_INJECT] = "dispatch to uinput",
+        [STAGE_TOTAL] = "read to uinput",
+    };
+    struct histogram *hist;
+    char buf[VDAGENTD_LATENCY_BUCKETS * 24];
+    unsigned int i, pos, count;
+    int s;
+
+    if (!latency)
+        return;
+
+    syslog(LOG_INFO, "mouse states: %u written, %u coalesced, %u dropped",
+           latency->results[VDAGENTD_LATENCY_WRITTEN],
+           latency->results[VDAGENTD_LATENCY_COALESCED],
+           latency->results[VDAGENTD_LATENCY_DROPPED]);
+
+    for (s = 0; s < STAGE_COUNT; s++) {
+        hist = &latency->stages[s];
+        for (i = 0, count = 0; i < VDAGENTD_LATENCY_BUCKETS; i++)
+            count += hist->buckets[i];
+        if (count == 0)
+            continue;
+
+        /* "<2^i us: count" for the non empty buckets */
+        for (i = 0, pos = 0; i < VDAGENTD_LATENCY_BUCKETS; i++) {
+            if (!hist->buckets[i])
+                continue;
+            if (i == VDAGENTD_LATENCY_BUCKETS - 1)
+                pos += snprintf(buf + pos, sizeof(buf) - pos, " >=%uus:%u",
+                                1u << (i - 1), hist->buckets[i]);
+            else
+                pos += snprintf(buf + pos, sizeof(buf) - pos, " <%uus:%u",
+                                1u << i, hist->buckets[i]);
+        }
+        syslog(LOG_INFO, "mouse %s: avg %lluus, max %lluus,%s",
+               stage_to_string[s],
+               (unsigned long long)(hist->sum / count),
+               (unsigned long long)hist->max, buf);
+    }
+}
@@ -0,0 +1,52 @@
+/*  vdagentd-latency.h vdagentd mouse latency statistics header
+
+    Copyright 2026 The spice-vdagent contributors
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __VDAGENTD_LATENCY_H
+#define __VDAGENTD_LATENCY_H
+
+#include <stdint.h>
+
+/* Number of buckets of the latency histograms, bucket 0 counts latencies
+   below 1 microsecond, bucket i those below 2^i microseconds, and the last
+   one all longer ones */
+#define VDAGENTD_LATENCY_BUCKETS 20
+
+/* What happened to a mouse state */
+enum {
+    VDAGENTD_LATENCY_WRITTEN,   /* written to the tablet */
+    VDAGENTD_LATENCY_COALESCED, /* nothing changed, so nothing was written */
+    VDAGENTD_LATENCY_DROPPED,   /* no tablet, or unknown monitor */
+};
+
+struct vdagentd_latency;
+
+struct vdagentd_latency *vdagentd_latency_create(void);
+void vdagentd_latency_destroy(struct vdagentd_latency **latencyp);
+
+/* Account for a mouse state, times in microseconds (see
+   vdagentd_timer_get_time_us): read is when its first chunk was read from
+   the virtio port, dispatch when it got handled and written when it was
+   written to the tablet. result is one of the enum above, written is not
+   used unless it is VDAGENTD_LATENCY_WRITTEN. */
+void vdagentd_latency_add(struct vdagentd_latency *latency, int result,
+    uint64_t read, uint64_t dispatch, uint64_t written);
+
+/* Write the counters and the histograms of the read to dispatch, dispatch to
+   written and read to written times to syslog */
+void vdagentd_latency_dump(struct vdagentd_latency *latency);
+
+#endif
@@ -34,6 +34,9 @@ static const char * const vdagentd_messages[] = {
         "file xfer status",
         "file xfer data",
         "client disconnected",
+        "max clipboard",
+        "clipboard type",
+        "clipboard regrab",
 };
 
 #endif
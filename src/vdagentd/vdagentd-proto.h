@@ -31,18 +31,40 @@ enum {
                                        vdagentd_guest_xorg_resolution */
     VDAGENTD_MONITORS_CONFIG, /* daemon -> client, VDAgentMonitorsConfig
                                  followed by num_monitors VDAgentMonConfig-s */
-    VDAGENTD_CLIPBOARD_GRAB,    /* arg1: sel, data: array of supported types */
-    VDAGENTD_CLIPBOARD_REQUEST, /* arg1: selection, arg 2 = type */
-    VDAGENTD_CLIPBOARD_DATA,    /* arg1: sel, arg 2: type, data: data */
+    VDAGENTD_CLIPBOARD_GRAB,    /* arg1: sel, data: array of uint16_t ids of
+                                   the supported types, client -> daemon:
+                                   arg2: X window id of the selection owner,
+                                   0 if unknown, data: empty if only the
+                                   contents changed since the last grab */
+    VDAGENTD_CLIPBOARD_REQUEST, /* arg1: selection, arg 2: request id (client
+                                   -> daemon), data: uint16_t type id */
+    VDAGENTD_CLIPBOARD_DATA,    /* arg1: sel, arg 2: id of the request this
+                                   answers (daemon -> client), data: uint16_t
+                                   type id + data, empty if there is no data */
     VDAGENTD_CLIPBOARD_RELEASE, /* arg1: selection */
     VDAGENTD_VERSION,           /* daemon -> client, data: version string */
     VDAGENTD_FILE_XFER_START,
     VDAGENTD_FILE_XFER_STATUS,
     VDAGENTD_FILE_XFER_DATA,
     VDAGENTD_CLIENT_DISCONNECTED,  /* daemon -> client */
+    VDAGENTD_MAX_CLIPBOARD,     /* daemon -> client, arg1: max clipboard data
+                                   size as int32_t, -1 for no limit */
+    VDAGENTD_CLIPBOARD_TYPE,    /* arg1: type id, data: type. Both sides pick
+                                   the ids for the types they send, and
+                                   announce each one before its first use.
+                                   An id may be announced again later with
+                                   another type, which replaces the old one */
+    VDAGENTD_CLIPBOARD_REGRAB,  /* daemon -> client, arg1: selection, the
+                                   last grab was empty but the vdagent client
+                                   does not know the types, send them again */
     VDAGENTD_NO_MESSAGES /* Must always be last */
 };
 
+/* The size of clipboard data with a type of type_len chars, which both sides
+   check against the max clipboard size: the client sends the type name and
+   its 0 terminator in front of the data */
+#define VDAGENTD_CLIPBOARD_DATA_SIZE(type_len, size) ((type_len) + 1 + (size))
+
 struct vdagentd_guest_xorg_resolution {
     int width;
     int height;
@@ -0,0 +1,160 @@
+/*  vdagentd-timer.c vdagentd main loop timers code
+
+    Copyright 2026 The spice-vdagent contributors
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <time.h>
+#include "vdagentd-timer.h"
+
+struct vdagentd_timer {
+    uint64_t deadline;
+    unsigned int interval;
+    int active;
+    vdagentd_timer_callback callback;
+    void *user_data;
+
+    struct vdagentd_timer *next;
+};
+
+/* Armed timers, sorted by deadline, so that the head is the next to fire */
+static struct vdagentd_timer *timers = NULL;
+
+uint64_t vdagentd_timer_get_time(void)
+{
+    return vdagentd_timer_get_time_us() / 1000;
+}
+
+uint64_t vdagentd_timer_get_time_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void timer_unlink(struct vdagentd_timer *timer)
+{
+    struct vdagentd_timer **timerp;
+
+    if (!timer->active)
+        return;
+
+    for (timerp = &timers; *timerp; timerp = &(*timerp)->next) {
+        if (*timerp == timer) {
+            *timerp = timer->next;
+            break;
+        }
+    }
+    timer->next = NULL;
+    timer->active = 0;
+}
+
+static void timer_link(struct vdagentd_timer *timer)
+{
+    struct vdagentd_timer **timerp;
+
+    /* Insert after timers with the same deadline, so that they fire in the
+       order in which they were started */
+    timerp = &timers;
+    while (*timerp && (*timerp)->deadline <= timer->deadline)
+        timerp = &(*timerp)->next;
+
+    timer->next = *timerp;
+    *timerp = timer;
+    timer->active = 1;
+}
+
+struct vdagentd_timer *vdagentd_timer_create(
+    vdagentd_timer_callback callback, void *user_data)
+{
+    struct vdagentd_timer *timer;
+
+    timer = calloc(1, sizeof(*timer));
+    if (!timer)
+        return NULL;
+
+    timer->callback = callback;
+    timer->user_data = user_data;
+
+    return timer;
+}
+
+void vdagentd_timer_destroy(struct vdagentd_timer **timerp)
+{
+    struct vdagentd_timer *timer = *timerp;
+
+    if (!timer)
+        return;
+
+    timer_unlink(timer);
+    free(timer);
+    *timerp = NULL;
+}
+
+void vdagentd_timer_start(struct vdagentd_timer *timer,
+    unsigned int timeout, unsigned int interval)
+{
+    timer_unlink(timer);
+    timer->deadline = vdagentd_timer_get_time() + timeout;
+    timer->interval = interval;
+    timer_link(timer);
+}
+
+void vdagentd_timer_stop(struct vdagentd_timer *timer)
+{
+    if (timer)
+        timer_unlink(timer);
+}
+
+int vdagentd_timer_is_active(struct vdagentd_timer *timer)
+{
+    return timer && timer->active;
+}
+
+int vdagentd_timer_get_timeout(void)
+{
+    uint64_t now;
+
+    if (!timers)
+        return -1;
+
+    now = vdagentd_timer_get_time();
+    return timers->deadline > now ? timers->deadline - now : 0;
+}
+
+void vdagentd_timer_dispatch(void)
+{
+    struct vdagentd_timer *timer;
+    uint64_t now = vdagentd_timer_get_time();
+
+    /* The callback may destroy the timer, so it must not be touched after
+       calling it, and be re-armed before doing so if periodic. */
+    while ((timer = timers) && timer->deadline <= now) {
+        timer_unlink(timer);
+        if (timer->interval) {
+            /* Don't try to catch up on missed periods */
+            timer->deadline += timer->interval;
+            if (timer->deadline <= now)
+                timer->deadline = now + timer->interval;
+            timer_link(timer);
+        }
+        timer->callback(timer->user_data);
+    }
+}
@@ -0,0 +1,58 @@
+/*  vdagentd-timer.h vdagentd main loop timers header
+
+    Copyright 2026 The spice-vdagent contributors
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __VDAGENTD_TIMER_H
+#define __VDAGENTD_TIMER_H
+
+#include <stdint.h>
+
+struct vdagentd_timer;
+
+/* Callbacks with this type will be called from the main loop when a timer
+   fires. The callback may (re)start, stop or destroy the timer. */
+typedef void (*vdagentd_timer_callback)(void *user_data);
+
+/* Create a timer, which is not armed until vdagentd_timer_start is called */
+struct vdagentd_timer *vdagentd_timer_create(
+    vdagentd_timer_callback callback, void *user_data);
+
+/* The contents of timerp will be made NULL */
+void vdagentd_timer_destroy(struct vdagentd_timer **timerp);
+
+/* (Re)arm timer to fire timeout milliseconds from now. If interval is not 0
+   the timer will keep firing every interval milliseconds after that, until
+   stopped. */
+void vdagentd_timer_start(struct vdagentd_timer *timer,
+    unsigned int timeout, unsigned int interval);
+
+void vdagentd_timer_stop(struct vdagentd_timer *timer);
+int vdagentd_timer_is_active(struct vdagentd_timer *timer);
+
+/* Return the current CLOCK_MONOTONIC time in milliseconds */
+uint64_t vdagentd_timer_get_time(void);
+
+/* Same as vdagentd_timer_get_time, but in microseconds */
+uint64_t vdagentd_timer_get_time_us(void);
+
+/* For main loop usage: return the number of milliseconds until the next
+   timer fires, or -1 if no timers are armed */
+int vdagentd_timer_get_timeout(void);
+
+/* For main loop usage: call the callbacks of all timers which are due */
+void vdagentd_timer_dispatch(void);
+
+#endif
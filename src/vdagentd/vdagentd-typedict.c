@@ -0,0 +1,221 @@
+/*  vdagentd-typedict.c vdagentd clipboard type dictionary code
+
+    Copyright 2026 The spice-vdagent contributors
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include "vdagentd-typedict.h"
+
+/* Number of hash chains for the types we send */
+#define HASH_SIZE 64
+
+struct sent_type {
+    char *type;
+    uint32_t hash;
+    uint16_t id;
+    struct sent_type *next;
+};
+
+struct vdagentd_typedict {
+    /* types we sent, by hash */
+    struct sent_type *sent[HASH_SIZE];
+    uint16_t last_id;
+    /* the number of types we sent and the size of their names */
+    uint32_t sent_count;
+    uint32_t sent_size;
+    /* types the peer sent, indexed by id */
+    char **received;
+    uint32_t received_count;
+};
+
+static uint32_t hash_type(const char *type)
+{
+    uint32_t hash = 5381;
+
+    while (*type)
+        hash = hash * 33 + (uint8_t)*type++;
+
+    return hash;
+}
+
+struct vdagentd_typedict *vdagentd_typedict_create(void)
+{
+    return calloc(1, sizeof(struct vdagentd_typedict));
+}
+
+static void forget_sent(struct vdagentd_typedict *dict)
+{
+    struct sent_type *sent, *next;
+    uint32_t i;
+
+    for (i = 0; i < HASH_SIZE; i++) {
+        for (sent = dict->sent[i]; sent; sent = next) {
+            next = sent->next;
+            free(sent->type);
+            free(sent);
+        }
+        dict->sent[i] = NULL;
+    }
+    dict->last_id = 0;
+    dict->sent_count = 0;
+    dict->sent_size = 0;
+}
+
+void vdagentd_typedict_destroy(struct vdagentd_typedict **dictp)
+{
+    struct vdagentd_typedict *dict = *dictp;
+    uint32_t i;
+
+    if (!dict)
+        return;
+
+    forget_sent(dict);
+    for (i = 0; i < dict->received_count; i++)
+        free(dict->received[i]);
+    free(dict->received);
+    free(dict);
+    *dictp = NULL;
+}
+
+static struct sent_type *lookup_sent(struct vdagentd_typedict *dict,
+    const char *type, uint32_t hash)
+{
+    struct sent_type *sent;
+
+    for (sent = dict->sent[hash % HASH_SIZE]; sent; sent = sent->next) {
+        if (sent->hash == hash && !strcmp(sent->type, type))
+            return sent;
+    }
+
+    return NULL;
+}
+
+void vdagentd_typedict_reserve(struct vdagentd_typedict *dict,
+    const uint8_t *types, uint32_t size)
+{
+    const char *type;
+    uint32_t pos, len, count = 0, new_size = 0;
+
+    for (pos = 0; pos < size; pos += len + 1) {
+        type = (const char *)types + pos;
+        len = strnlen(type, size - pos);
+        if (len == size - pos)
+            break;
+        if (!lookup_sent(dict, type, hash_type(type))) {
+            count++;
+            new_size += len + 1;
+        }
+    }
+
+    if (dict->sent_count + count <= VDAGENTD_TYPEDICT_MAX_TYPES &&
+            dict->sent_size + new_size <= VDAGENTD_TYPEDICT_MAX_SIZE)
+        return;
+
+    syslog(LOG_INFO, "clipboard type dictionary full, starting over");
+    forget_sent(dict);
+}
+
+uint16_t vdagentd_typedict_get_id(struct vdagentd_typedict *dict,
+    const char *type, int *is_new)
+{
+    struct sent_type *sent;
+    uint32_t hash = hash_type(type), size = strlen(type) + 1;
+
+    *is_new = 0;
+    sent = lookup_sent(dict, type, hash);
+    if (sent)
+        return sent->id;
+
+    /* Only happens when a single message has too many types */
+    if (dict->sent_count == VDAGENTD_TYPEDICT_MAX_TYPES ||
+            size > VDAGENTD_TYPEDICT_MAX_SIZE - dict->sent_size) {
+        syslog(LOG_ERR, "clipboard type dictionary full, dropping type %s",
+               type);
+        return 0;
+    }
+
+    sent = malloc(sizeof(*sent));
+    if (!sent)
+        goto error;
+    sent->type = strdup(type);
+    if (!sent->type) {
+        free(sent);
+        goto error;
+    }
+    sent->hash = hash;
+    sent->id = ++dict->last_id;
+    dict->sent_count++;
+    dict->sent_size += size;
+    sent->next = dict->sent[hash % HASH_SIZE];
+    dict->sent[hash % HASH_SIZE] = sent;
+
+    *is_new = 1;
+    return sent->id;
+
+error:
+    syslog(LOG_ERR, "out of memory allocating clipboard type");
+    return 0;
+}
+
+int vdagentd_typedict_add_type(struct vdagentd_typedict *dict, uint16_t id,
+    const uint8_t *type, uint32_t size)
+{
+    char **received;
+    char *copy;
+
+    if (id == 0 || size < 2 || type[size - 1] != '\0' ||
+            memchr(type, '\0', size - 1)) {
+        syslog(LOG_ERR, "invalid clipboard type announced for id %u", id);
+        return -1;
+    }
+
+    if (id >= dict->received_count) {
+        received = realloc(dict->received, (id + 1) * sizeof(char *));
+        if (!received)
+            goto error;
+        memset(received + dict->received_count, 0,
+               (id + 1 - dict->received_count) * sizeof(char *));
+        dict->received = received;
+        dict->received_count = id + 1;
+    }
+
+    copy = malloc(size);
+    if (!copy)
+        goto error;
+    memcpy(copy, type, size);
+    free(dict->received[id]);
+    dict->received[id] = copy;
+
+    return 0;
+
+error:
+    syslog(LOG_ERR, "out of memory allocating clipboard type");
+    return -1;
+}
+
+const char *vdagentd_typedict_get_type(struct vdagentd_typedict *dict,
+    uint16_t id)
+{
+    if (id >= dict->received_count)
+        return NULL;
+
+    return dict->received[id];
+}
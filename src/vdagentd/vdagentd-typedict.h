@@ -0,0 +1,65 @@
+/*  vdagentd-typedict.h vdagentd clipboard type dictionary header
+
+    Copyright 2026 The spice-vdagent contributors
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __VDAGENTD_TYPEDICT_H
+#define __VDAGENTD_TYPEDICT_H
+
+#include <stdint.h>
+
+/* Clipboard messages on the udscs connection refer to types by a 16 bit id,
+   each side picks the ids for the types it sends and announces them once
+   with a VDAGENTD_CLIPBOARD_TYPE message. A dictionary tracks both
+   directions of a single connection. Id 0 is never used.
+
+   The client picks the type names, so the types we send are limited to
+   VDAGENTD_TYPEDICT_MAX_TYPES, with names of VDAGENTD_TYPEDICT_MAX_SIZE bytes
+   in total. When these would be exceeded all of them are forgotten and ids
+   start over from 1, an id announced again refers to the new type from
+   then on. */
+#define VDAGENTD_TYPEDICT_MAX_TYPES 1024
+#define VDAGENTD_TYPEDICT_MAX_SIZE (64 * 1024)
+
+struct vdagentd_typedict;
+
+struct vdagentd_typedict *vdagentd_typedict_create(void);
+void vdagentd_typedict_destroy(struct vdagentd_typedict **dictp);
+
+/* Make room for the types (size bytes of 0 terminated names) of a message
+   to the peer, call this before getting their ids, so a message never mixes
+   ids from before and after starting over */
+void vdagentd_typedict_reserve(struct vdagentd_typedict *dict,
+    const uint8_t *types, uint32_t size);
+
+/* Return the id to use for type in messages to the peer, or 0 when the
+   dictionary is full (only if the message has too many types to reserve
+   room for them) or out of memory. If the id has not been used before
+   *is_new gets set to 1, and the id must be announced to the peer before it
+   is used. */
+uint16_t vdagentd_typedict_get_id(struct vdagentd_typedict *dict,
+    const char *type, int *is_new);
+
+/* Record an id announced by the peer, type is size bytes including the
+   terminating 0. Returns 0 on success -1 on error (invalid id or type, or
+   out of memory) */
+int vdagentd_typedict_add_type(struct vdagentd_typedict *dict, uint16_t id,
+    const uint8_t *type, uint32_t size);
+
+/* Return the type the peer announced with id, NULL if it did not */
+const char *vdagentd_typedict_get_type(struct vdagentd_typedict *dict,
+    uint16_t id);
+
+#endif
@@ -24,6 +24,7 @@
 #endif
 
 #include <stdlib.h>
+#include <string.h>
 #include <syslog.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -31,20 +32,40 @@
 #include <linux/input.h>
 #include <linux/uinput.h>
 #include <spice/vd_agent.h>
+#include "vdagentd-timer.h"
 #include "vdagentd-uinput.h"
 
+/* The tablet always reports positions in the range 0 - TABLET_MAX, whatever
+   the screen size, so it never needs to be re-created on resolution changes */
+#define TABLET_MAX 32767
+
+/* Events for one mouse state: x, y, 3 buttons, 2 wheel directions and syn */
+#define MAX_EVENTS 8
+
 struct vdagentd_uinput {
     const char *devname;
     int fd;
     int debug;
     int width;
     int height;
+    /* offsets of the monitors */
     struct vdagentd_guest_xorg_resolution *screen_info;
     int screen_count;
+    /* positions are scaled by multiplying with scale_x / scale_y >> 32 */
+    uint64_t scale_x;
+    uint64_t scale_y;
     VDAgentMouseState last;
     int fake;
 };
 
+/* Return the scale factor for positions in 0 - size-1. This is rounded up,
+   so that for sizes up to 65536 the scaled positions are exactly
+   pos * TABLET_MAX / (size - 1), and size-1 maps to TABLET_MAX */
+static uint64_t uinput_scale(int size)
+{
+    return (((uint64_t)TABLET_MAX << 32) + size - 2) / (size - 1);
+}
+
 struct vdagentd_uinput *vdagentd_uinput_create(const char *devname,
     int width, int height,
     struct vdagentd_guest_xorg_resolution *screen_info, int screen_count,
@@ -76,6 +97,7 @@ void vdagentd_uinput_destroy(struct vdagentd_uinput **uinputp)
 
     if (uinput->fd != -1)
         close(uinput->fd);
+    free(uinput->screen_info);
     free(uinput);
     *uinputp = NULL;
 }
@@ -88,13 +110,8 @@ void vdagentd_uinput_update_size(struct vdagentd_uinput **uinputp,
     struct vdagentd_uinput *uinput = *uinputp;
     struct uinput_user_dev device = {
         .name = "spice vdagent tablet",
-#ifdef WITH_STATIC_UINPUT
-        .absmax  [ ABS_X ] = 32767,
-        .absmax  [ ABS_Y ] = 32767,
-#else
-        .absmax  [ ABS_X ] = width - 1,
-        .absmax  [ ABS_Y ] = height - 1,
-#endif
+        .absmax  [ ABS_X ] = TABLET_MAX,
+        .absmax  [ ABS_Y ] = TABLET_MAX,
     };
     int i, rc;
 
@@ -105,23 +122,39 @@ void vdagentd_uinput_update_size(struct vdagentd_uinput **uinputp,
                    screen_info[i].y);
     }
 
-    uinput->screen_info  = screen_info;
-    uinput->screen_count = screen_count;
-
-    if (uinput->width == width && uinput->height == height)
-        return;
-
+    free(uinput->screen_info);
+    uinput->screen_info = NULL;
+    uinput->screen_count = 0;
+    if (screen_count) {
+        uinput->screen_info = malloc(screen_count * sizeof(*screen_info));
+        if (!uinput->screen_info) {
+            syslog(LOG_ERR, "out of memory allocating uinput screen info");
+        } else {
+            memcpy(uinput->screen_info, screen_info,
+                   screen_count * sizeof(*screen_info));
+            uinput->screen_count = screen_count;
+        }
+    }
     uinput->width  = width;
     uinput->height = height;
 
+    /* the fake device is read by Xspice, which wants pixels */
+    if (uinput->fake || width <= 1 || height <= 1) {
+        uinput->scale_x = 1ULL << 32;
+        uinput->scale_y = 1ULL << 32;
+    } else {
+        uinput->scale_x = uinput_scale(width);
+        uinput->scale_y = uinput_scale(height);
+    }
+
+    /* positions get scaled to the new size, the device stays the same */
     if (uinput->fd != -1)
-#ifndef WITH_STATIC_UINPUT
-        close(uinput->fd);
-#else
         return;
-#endif
 
-    uinput->fd = open(uinput->devname, uinput->fake ? O_WRONLY : O_RDWR);
+    if (uinput->fake == VDAGENTD_UINPUT_RECORD)
+        uinput->fd = open(uinput->devname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    else
+        uinput->fd = open(uinput->devname, uinput->fake ? O_WRONLY : O_RDWR);
     if (uinput->fd == -1) {
         syslog(LOG_ERR, "open %s: %m", uinput->devname);
         vdagentd_uinput_destroy(uinputp);
@@ -162,26 +195,20 @@ void vdagentd_uinput_update_size(struct vdagentd_uinput **uinputp,
     }
 }
 
-static void uinput_send_event(struct vdagentd_uinput **uinputp,
+static void uinput_add_event(struct input_event *events, int *n,
     __u16 type, __u16 code, __s32 value)
 {
-    struct vdagentd_uinput *uinput = *uinputp;
-    struct input_event event = {
-        .type  = type,
-        .code  = code,
-        .value = value,
-    };
-    int rc;
+    struct input_event *event = &events[(*n)++];
 
-    rc = write(uinput->fd, &event, sizeof(event));
-    if (rc != sizeof(event)) {
-        syslog(LOG_ERR, "write %s: %m", uinput->devname);
-        vdagentd_uinput_destroy(uinputp);
-    }
+    memset(event, 0, sizeof(*event));
+    event->type  = type;
+    event->code  = code;
+    event->value = value;
 }
 
-void vdagentd_uinput_do_mouse(struct vdagentd_uinput **uinputp,
-        VDAgentMouseState *mouse)
+int vdagentd_uinput_do_mouse(struct vdagentd_uinput **uinputp,
+        VDAgentMouseState *mouse, uint32_t msg_id, uint64_t read,
+        uint64_t dispatch)
 {
     struct vdagentd_uinput *uinput = *uinputp;
     struct button_s {
@@ -198,36 +225,39 @@ void vdagentd_uinput_do_mouse(struct vdagentd_uinput **uinputp,
         { .name = "up",     .mask =  VD_AGENT_UBUTTON_MASK, .btn = 1  },
         { .name = "down",   .mask =  VD_AGENT_DBUTTON_MASK, .btn = -1 },
     };
-    int i, down;
+    struct input_event events[MAX_EVENTS];
+    struct vdagentd_uinput_record records[MAX_EVENTS];
+    const void *buf = events;
+    size_t size;
+    int i, n = 0, down, rc;
 
-    if (*uinputp) {
-        if (mouse->display_id >= uinput->screen_count) {
-            syslog(LOG_WARNING, "mouse event for unknown monitor (%d >= %d)",
-                   mouse->display_id, uinput->screen_count);
-            return;
-        }
-        if (uinput->debug)
-            syslog(LOG_DEBUG, "mouse-event: mon %d %dx%d", mouse->display_id,
-                   mouse->x, mouse->y);
-        mouse->x += uinput->screen_info[mouse->display_id].x;
-        mouse->y += uinput->screen_info[mouse->display_id].y;
-#ifdef WITH_STATIC_UINPUT
-        mouse->x = mouse->x * 32767 / (uinput->width - 1);
-        mouse->y = mouse->y * 32767 / (uinput->height - 1);
-#endif
-    }
+    if (!uinput)
+        return VDAGENTD_LATENCY_DROPPED;
 
-    if (*uinputp && uinput->last.x != mouse->x) {
+    if (mouse->display_id >= uinput->screen_count) {
+        syslog(LOG_WARNING, "mouse event for unknown monitor (%d >= %d)",
+               mouse->display_id, uinput->screen_count);
+        return VDAGENTD_LATENCY_DROPPED;
+    }
+    if (uinput->debug)
+        syslog(LOG_DEBUG, "mouse-event: mon %d %dx%d", mouse->display_id,
+               mouse->x, mouse->y);
+    mouse->x = ((mouse->x + uinput->screen_info[mouse->display_id].x) *
+                uinput->scale_x) >> 32;
+    mouse->y = ((mouse->y + uinput->screen_info[mouse->display_id].y) *
+                uinput->scale_y) >> 32;
+
+    if (uinput->last.x != mouse->x) {
         if (uinput->debug)
             syslog(LOG_DEBUG, "mouse: abs-x %d", mouse->x);
-        uinput_send_event(uinputp, EV_ABS, ABS_X, mouse->x);
+        uinput_add_event(events, &n, EV_ABS, ABS_X, mouse->x);
     }
-    if (*uinputp && uinput->last.y != mouse->y) {
+    if (uinput->last.y != mouse->y) {
         if (uinput->debug)
             syslog(LOG_DEBUG, "mouse: abs-y %d", mouse->y);
-        uinput_send_event(uinputp, EV_ABS, ABS_Y, mouse->y);
+        uinput_add_event(events, &n, EV_ABS, ABS_Y, mouse->y);
     }
-    for (i = 0; i < sizeof(btns)/sizeof(btns[0]) && *uinputp; i++) {
+    for (i = 0; i < sizeof(btns)/sizeof(btns[0]); i++) {
         if ((uinput->last.buttons & btns[i].mask) ==
                 (mouse->buttons & btns[i].mask))
             continue;
@@ -235,25 +265,54 @@ void vdagentd_uinput_do_mouse(struct vdagentd_uinput **uinputp,
         if (uinput->debug)
             syslog(LOG_DEBUG, "mouse: btn-%s %s",
                     btns[i].name, down ? "down" : "up");
-        uinput_send_event(uinputp, EV_KEY, btns[i].btn, down);
+        uinput_add_event(events, &n, EV_KEY, btns[i].btn, down);
     }
-    for (i = 0; i < sizeof(wheel)/sizeof(wheel[0]) && *uinputp; i++) {
+    for (i = 0; i < sizeof(wheel)/sizeof(wheel[0]); i++) {
         if ((uinput->last.buttons & wheel[i].mask) ==
                 (mouse->buttons & wheel[i].mask))
             continue;
         if (mouse->buttons & wheel[i].mask) {
             if (uinput->debug)
                 syslog(LOG_DEBUG, "mouse: wheel-%s", wheel[i].name);
-            uinput_send_event(uinputp, EV_REL, REL_WHEEL, wheel[i].btn);
+            uinput_add_event(events, &n, EV_REL, REL_WHEEL, wheel[i].btn);
         }
     }
 
-    if (*uinputp) {
-        if (uinput->debug)
-            syslog(LOG_DEBUG, "mouse: syn");
-        uinput_send_event(uinputp, EV_SYN, SYN_REPORT, 0);
+    if (n == 0) {
+        /* A wheel button release writes nothing, but must still be
+           remembered, or the next press of it would be seen as no change */
+        uinput->last = *mouse;
+        return VDAGENTD_LATENCY_COALESCED;
     }
 
-    if (*uinputp)
-        uinput->last = *mouse;
+    if (uinput->debug)
+        syslog(LOG_DEBUG, "mouse: syn");
+    uinput_add_event(events, &n, EV_SYN, SYN_REPORT, 0);
+
+    size = n * sizeof(events[0]);
+    if (uinput->fake == VDAGENTD_UINPUT_RECORD) {
+        uint64_t now = vdagentd_timer_get_time_us();
+
+        memset(records, 0, n * sizeof(records[0]));
+        for (i = 0; i < n; i++) {
+            records[i].msg_id = msg_id;
+            records[i].read = read;
+            records[i].dispatch = dispatch;
+            records[i].written = now;
+            records[i].event = events[i];
+        }
+        buf = records;
+        size = n * sizeof(records[0]);
+    }
+
+    /* one write for the whole state */
+    rc = write(uinput->fd, buf, size);
+    if (rc != size) {
+        syslog(LOG_ERR, "write %s: %m", uinput->devname);
+        vdagentd_uinput_destroy(uinputp);
+        return VDAGENTD_LATENCY_DROPPED;
+    }
+
+    uinput->last = *mouse;
+    return VDAGENTD_LATENCY_WRITTEN;
 }
@@ -23,7 +23,29 @@
 #define __VDAGENTD_UINPUT_H
 
 #include <stdio.h>
+#include <stdint.h>
+#include <linux/input.h>
 #include "vdagentd-proto.h"
+#include "vdagentd-latency.h"
+
+/* Values for the fake argument of vdagentd_uinput_create */
+enum {
+    VDAGENTD_UINPUT_REAL,   /* a real uinput device */
+    VDAGENTD_UINPUT_FAKE,   /* a file or fifo, which gets input_event-s */
+    VDAGENTD_UINPUT_RECORD, /* a file or fifo, which gets a
+                               vdagentd_uinput_record per event */
+};
+
+/* What a VDAGENTD_UINPUT_RECORD device gets for every event, all times are
+   in microseconds, see vdagentd_timer_get_time_us */
+struct vdagentd_uinput_record {
+    uint32_t msg_id;    /* number of the mouse message the event is for */
+    uint32_t reserved;
+    uint64_t read;      /* when the message started coming in, 0 if unknown */
+    uint64_t dispatch;  /* when the message got handled */
+    uint64_t written;   /* when the event was written */
+    struct input_event event;
+};
 
 struct vdagentd_uinput;
 
@@ -33,8 +55,14 @@ struct vdagentd_uinput *vdagentd_uinput_create(const char *devname,
     int debug, int fake);
 void vdagentd_uinput_destroy(struct vdagentd_uinput **uinputp);
 
-void vdagentd_uinput_do_mouse(struct vdagentd_uinput **uinputp,
-        VDAgentMouseState *mouse);
+/* Write the changes from the last mouse state to the tablet. msg_id, read
+   and dispatch are only used by recording devices, see
+   vdagentd_uinput_record. Returns one of the VDAGENTD_LATENCY_* results */
+int vdagentd_uinput_do_mouse(struct vdagentd_uinput **uinputp,
+        VDAgentMouseState *mouse, uint32_t msg_id, uint64_t read,
+        uint64_t dispatch);
+/* Set the size of the screen and the position of its monitors, screen_info
+   gets copied */
 void vdagentd_uinput_update_size(struct vdagentd_uinput **uinputp,
         int width, int height,
         struct vdagentd_guest_xorg_resolution *screen_info,
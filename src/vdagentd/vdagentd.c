@@ -30,16 +30,25 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
 #include <signal.h>
 #include <syslog.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/select.h>
 #include <sys/stat.h>
 #include <spice/vd_agent.h>
 #include <glib.h>
 
 #include "udscs.h"
+#include "vdagentd-clipboard.h"
+#include "vdagentd-compress.h"
+#include "vdagentd-input-thread.h"
+#include "vdagentd-latency.h"
 #include "vdagentd-proto.h"
 #include "vdagentd-proto-strings.h"
+#include "vdagentd-timer.h"
+#include "vdagentd-typedict.h"
 #include "vdagentd-uinput.h"
 #include "vdagent-virtio-port.h"
 #include "session-info.h"
@@ -50,6 +59,7 @@ struct agent_data {
     int height;
     struct vdagentd_guest_xorg_resolution *screen_info;
     int screen_count;
+    struct vdagentd_typedict *types;
 };
 
 /* variables */
@@ -58,11 +68,22 @@ static const char *portdev = "/dev/virtio-ports/com.redhat.spice.0";
 static const char *vdagentd_socket = VDAGENTD_SOCKET;
 static const char *uinput_device = "/dev/uinput";
 static int debug = 0;
-static int uinput_fake = 0;
+static int grab_window = VDAGENTD_CLIPBOARD_GRAB_WINDOW;
+static int uinput_fake = VDAGENTD_UINPUT_REAL;
+static int uinput_record = 0;
+static uint32_t mouse_msg_id = 0;
+static int use_input_thread = 0;
+static int input_thread_priority = 0;
 static struct udscs_server *server = NULL;
 static struct vdagent_virtio_port *virtio_port = NULL;
+static struct vdagentd_input_thread *input_thread = NULL;
+/* Protects uinput, mouse_msg_id and mouse_latency, which the input thread
+   uses while handling mouse states */
+static pthread_mutex_t uinput_lock = PTHREAD_MUTEX_INITIALIZER;
 static struct session_info *session_info = NULL;
 static struct vdagentd_uinput *uinput = NULL;
+static struct vdagentd_clipboard *clipboard = NULL;
+static struct vdagentd_latency *mouse_latency = NULL;
 static VDAgentMonitorsConfig *mon_config = NULL;
 static uint32_t *capabilities = NULL;
 static int capabilities_size = 0;
@@ -71,11 +92,188 @@ static unsigned int session_count = 0;
 static struct udscs_connection *active_session_conn = NULL;
 static int agent_owns_clipboard[256] = { 0, };
 static int quit = 0;
+static volatile sig_atomic_t dump_log = 0;
 static int retval = 0;
 static int client_connected = 0;
 static int max_clipboard = -1;
 
+/* What the reader of the virtio port needs to know about the client for
+   decompressing its clipboard data as it comes in. With an input thread
+   reading runs ahead of the main loop, so the reader keeps its own copy of
+   these, see virtio_port_track_read */
+static int virtio_read_selection = 0;
+static int virtio_read_compressed = 0;
+static int virtio_read_max_clipboard = -1;
+
 /* utility functions */
+static void virtio_write_clipboard(uint8_t selection, uint32_t msg_type,
+    const uint8_t *data, uint32_t data_size);
+static void virtio_write_clipboard_prefixed(uint8_t selection,
+    uint32_t msg_type, const uint8_t *prefix, uint32_t prefix_size,
+    const uint8_t *data, uint32_t data_size);
+
+/* Return the type name at the start of the data of a clipboard request or
+   clipboard data message, NULL if there is none */
+static const char *clipboard_data_type(const uint8_t *data, uint32_t size)
+{
+    if (size == 0 || !memchr(data, '\0', size))
+        return NULL;
+
+    return (const char *)data;
+}
+
+/* Return the id of type for messages to the agent connected through conn,
+   announcing it first if it has not been used before, 0 on error */
+static uint16_t agent_type_id(struct udscs_connection *conn, const char *type)
+{
+    struct agent_data *agent_data = udscs_get_user_data(conn);
+    uint16_t id;
+    int is_new;
+
+    id = vdagentd_typedict_get_id(agent_data->types, type, &is_new);
+    if (id && is_new)
+        udscs_write(conn, VDAGENTD_CLIPBOARD_TYPE, id, 0,
+                    (const uint8_t *)type, strlen(type) + 1);
+
+    return id;
+}
+
+/* Write a clipboard message with types by name, as the client sends them, to
+   the agent connected through conn, which gets the type ids instead */
+static void agent_write_clipboard(struct udscs_connection *conn,
+    uint32_t msg_type, uint8_t selection, uint32_t arg2,
+    const uint8_t *data, uint32_t size)
+{
+    struct agent_data *agent_data = udscs_get_user_data(conn);
+    const char *type = clipboard_data_type(data, size);
+    uint16_t *ids, id = 0;
+    uint32_t pos, len, n = 0;
+
+    switch (msg_type) {
+    case VDAGENTD_CLIPBOARD_GRAB:
+        vdagentd_typedict_reserve(agent_data->types, data, size);
+        /* every type takes at least 2 bytes */
+        ids = malloc((size / 2 + 1) * sizeof(uint16_t));
+        if (!ids) {
+            syslog(LOG_ERR, "out of memory allocating clipboard grab");
+            return;
+        }
+        for (pos = 0; pos < size; pos += len + 1) {
+            type = (const char *)data + pos;
+            len = strnlen(type, size - pos);
+            if (len == 0 || len == size - pos)
+                break;
+            id = agent_type_id(conn, type);
+            if (id)
+                ids[n++] = id;
+        }
+        udscs_write(conn, msg_type, selection, arg2,
+                    (uint8_t *)ids, n * sizeof(uint16_t));
+        free(ids);
+        break;
+    case VDAGENTD_CLIPBOARD_REQUEST:
+        if (type) {
+            vdagentd_typedict_reserve(agent_data->types,
+                                      (const uint8_t *)type, strlen(type) + 1);
+            id = agent_type_id(conn, type);
+        }
+        /* without a type the agent answers with empty data */
+        udscs_write(conn, msg_type, selection, arg2,
+                    (uint8_t *)&id, id ? sizeof(id) : 0);
+        break;
+    case VDAGENTD_CLIPBOARD_DATA:
+        if (type) {
+            vdagentd_typedict_reserve(agent_data->types,
+                                      (const uint8_t *)type, strlen(type) + 1);
+            id = agent_type_id(conn, type);
+        }
+        if (!id) {
+            udscs_write(conn, msg_type, selection, arg2, NULL, 0);
+            break;
+        }
+        len = strlen(type) + 1;
+        udscs_write_prefixed(conn, msg_type, selection, arg2,
+                             (uint8_t *)&id, sizeof(id),
+                             data + len, size - len);
+        break;
+    default:
+        udscs_write(conn, msg_type, selection, arg2, data, size);
+    }
+}
+
+/* Turn the type ids in a clipboard grab from the agent connected through
+   conn back into type names, as the client expects them. Returns a newly
+   allocated message and updates size, or returns NULL with size set to 0 when
+   out of memory. */
+static uint8_t *agent_clipboard_grab_by_name(struct udscs_connection *conn,
+    const uint8_t *data, uint32_t *size)
+{
+    struct agent_data *agent_data = udscs_get_user_data(conn);
+    const char *type;
+    uint8_t *buf;
+    uint16_t id;
+    uint32_t i, pos, len, n = *size / sizeof(uint16_t);
+
+    /* the types followed by "\0\0", as the agent used to send them */
+    len = 2;
+    for (i = 0; i < n; i++) {
+        memcpy(&id, data + i * sizeof(id), sizeof(id));
+        type = vdagentd_typedict_get_type(agent_data->types, id);
+        if (type)
+            len += strlen(type) + 1;
+    }
+    buf = calloc(1, len);
+    if (!buf) {
+        syslog(LOG_ERR, "out of memory allocating clipboard message");
+        *size = 0;
+        return NULL;
+    }
+    for (i = 0, pos = 0; i < n; i++) {
+        memcpy(&id, data + i * sizeof(id), sizeof(id));
+        type = vdagentd_typedict_get_type(agent_data->types, id);
+        if (!type)
+            continue;
+        strcpy((char *)buf + pos, type);
+        pos += strlen(type) + 1;
+    }
+    *size = len;
+    return buf;
+}
+
+/* Return the name of the type whose id starts a clipboard request or data
+   message from the agent connected through conn, NULL if it has no (known)
+   type */
+static const char *agent_clipboard_type(struct udscs_connection *conn,
+    const uint8_t *data, uint32_t size)
+{
+    struct agent_data *agent_data = udscs_get_user_data(conn);
+    const char *type;
+    uint16_t id;
+
+    if (size < sizeof(id))
+        return NULL;
+
+    memcpy(&id, data, sizeof(id));
+    type = vdagentd_typedict_get_type(agent_data->types, id);
+    if (!type)
+        syslog(LOG_WARNING, "clipboard message with unknown type id %u", id);
+
+    return type;
+}
+
+/* Answer requests the peer will never answer with empty data */
+static void clipboard_request_expired(int requester, uint8_t selection,
+    const char *type, uint32_t id)
+{
+    if (requester == VDAGENTD_CLIPBOARD_CLIENT) {
+        if (virtio_port)
+            virtio_write_clipboard(selection, VD_AGENT_CLIPBOARD, NULL, 0);
+    } else if (active_session_conn) {
+        agent_write_clipboard(active_session_conn, VDAGENTD_CLIPBOARD_DATA,
+                              selection, id, NULL, 0);
+    }
+}
+
 /* vdagentd <-> spice-client communication handling */
 static void send_capabilities(struct vdagent_virtio_port *vport,
     uint32_t request)
@@ -83,7 +281,7 @@ static void send_capabilities(struct vdagent_virtio_port *vport,
     VDAgentAnnounceCapabilities *caps;
     uint32_t size;
 
-    size = sizeof(*caps) + VD_AGENT_CAPS_BYTES;
+    size = sizeof(*caps) + VDAGENTD_CAPS_SIZE * sizeof(uint32_t);
     caps = calloc(1, size);
     if (!caps) {
         syslog(LOG_ERR, "out of memory allocating capabilities array (write)");
@@ -98,6 +296,8 @@ static void send_capabilities(struct vdagent_virtio_port *vport,
     VD_AGENT_SET_CAPABILITY(caps->caps, VD_AGENT_CAP_GUEST_LINEEND_LF);
     VD_AGENT_SET_CAPABILITY(caps->caps, VD_AGENT_CAP_MAX_CLIPBOARD);
     VD_AGENT_SET_CAPABILITY(caps->caps, VD_AGENT_CAP_ANY_SELECTION_TYPE);
+    if (vdagentd_compress_capability() != -1)
+        VD_AGENT_SET_CAPABILITY(caps->caps, vdagentd_compress_capability());
 
     /* this flags are required by clients to do auto-conf, but are legacy */
     VD_AGENT_SET_CAPABILITY(caps->caps, VD_AGENT_CAP_MONITORS_CONFIG);
@@ -109,9 +309,27 @@ static void send_capabilities(struct vdagent_virtio_port *vport,
     free(caps);
 }
 
+/* For use while handling a message from the virtio port: return the time
+   (in microseconds) at which its first chunk was read */
+static uint64_t virtio_message_start_us(struct vdagent_virtio_port *vport,
+                                        int port_nr)
+{
+    if (input_thread)
+        return vdagentd_input_thread_get_message_start_us(input_thread);
+
+    return vdagent_virtio_port_get_message_start_us(vport, port_nr);
+}
+
 static void do_client_disconnect(void)
 {
+    int i;
+
     if (client_connected) {
+        vdagentd_clipboard_request_cancel_all(clipboard,
+                                              VDAGENTD_CLIPBOARD_AGENT);
+        vdagentd_clipboard_invalidate_all(clipboard);
+        for (i = 0; i < 256; i++)
+            vdagentd_clipboard_forget_grab(clipboard, i);
         udscs_server_write_all(server, VDAGENTD_CLIENT_DISCONNECTED, 0, 0,
                                NULL, 0);
         client_connected = 0;
@@ -182,11 +400,32 @@ static void do_client_capabilities(struct vdagent_virtio_port *vport,
     }
 }
 
+/* A new grab or release of selection makes any grab, release or data for
+   that selection still queued for the agent obsolete. The agent is still
+   waiting for an answer to its requests, so turn queued data into an
+   empty answer, which keeps the id of the request it answers. */
+static void agent_drop_superseded_clipboard(uint8_t selection)
+{
+    int n;
+
+    udscs_drop_pending(active_session_conn, selection,
+                       (1 << VDAGENTD_CLIPBOARD_GRAB) |
+                       (1 << VDAGENTD_CLIPBOARD_RELEASE));
+    n = udscs_empty_pending(active_session_conn, selection,
+                            1 << VDAGENTD_CLIPBOARD_DATA);
+    if (n && debug)
+        syslog(LOG_DEBUG, "emptied %d superseded clipboard data msg(s) "
+               "for the agent", n);
+}
+
 static void do_client_clipboard(struct vdagent_virtio_port *vport,
     VDAgentMessage *message_header, uint8_t *data)
 {
     uint32_t msg_type = 0, data_type = 0, size = message_header->size;
     uint8_t selection = VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD;
+    const uint8_t *cached;
+    const char *type;
+    uint32_t cached_size, type_size, backlog;
 
     if (!active_session_conn) {
         syslog(LOG_WARNING,
@@ -213,20 +452,147 @@ static void do_client_clipboard(struct vdagent_virtio_port *vport,
     case VD_AGENT_CLIPBOARD_GRAB:
         msg_type = VDAGENTD_CLIPBOARD_GRAB;
         agent_owns_clipboard[selection] = 0;
+        vdagentd_clipboard_invalidate(clipboard, selection);
+        vdagentd_clipboard_forget_grab(clipboard, selection);
+        agent_drop_superseded_clipboard(selection);
         break;
     case VD_AGENT_CLIPBOARD_REQUEST:
         msg_type = VDAGENTD_CLIPBOARD_REQUEST;
+        if (!vdagentd_clipboard_cache_lookup(clipboard,
+                                             VDAGENTD_CLIPBOARD_CLIENT,
+                                             selection,
+                                             clipboard_data_type(data, size),
+                                             &cached, &cached_size)) {
+            virtio_write_clipboard(selection, VD_AGENT_CLIPBOARD,
+                                   cached, cached_size);
+            return;
+        }
         break;
     case VD_AGENT_CLIPBOARD:
         msg_type = VDAGENTD_CLIPBOARD_DATA;
+        type = clipboard_data_type(data, size);
+        type_size = type ? strlen(type) + 1 : size;
+        if (vdagentd_clipboard_request_done(clipboard,
+                                            VDAGENTD_CLIPBOARD_AGENT, selection,
+                                            type, data + type_size,
+                                            size - type_size,
+                                            virtio_message_start_us(
+                                                vport, VDP_CLIENT_PORT) / 1000,
+                                            udscs_get_pending_size(
+                                                active_session_conn),
+                                            &data_type))
+            return;
         break;
     case VD_AGENT_CLIPBOARD_RELEASE:
         msg_type = VDAGENTD_CLIPBOARD_RELEASE;
+        vdagentd_clipboard_invalidate(clipboard, selection);
+        agent_drop_superseded_clipboard(selection);
         break;
     }
 
-    udscs_write(active_session_conn, msg_type, selection, data_type,
-                data, size);
+    backlog = udscs_get_pending_size(active_session_conn);
+    agent_write_clipboard(active_session_conn, msg_type, selection, data_type,
+                          data, size);
+
+    if (msg_type == VDAGENTD_CLIPBOARD_REQUEST)
+        vdagentd_clipboard_request_add(clipboard, VDAGENTD_CLIPBOARD_CLIENT,
+                                       selection,
+                                       clipboard_data_type(data, size),
+                                       0, backlog);
+}
+
+/* Must be called with uinput_lock held */
+static void do_client_mouse(VDAgentMouseState *mouse, uint64_t read)
+{
+    uint64_t dispatch = vdagentd_timer_get_time_us();
+    int result;
+
+    result = vdagentd_uinput_do_mouse(&uinput, mouse, ++mouse_msg_id, read,
+                                      dispatch);
+    vdagentd_latency_add(mouse_latency, result, read, dispatch,
+                         vdagentd_timer_get_time_us());
+}
+
+/* Must be called by the reader of the virtio port for every message read */
+static void virtio_port_track_read(VDAgentMessage *message_header,
+    uint8_t *data)
+{
+    VDAgentAnnounceCapabilities *caps = (VDAgentAnnounceCapabilities *)data;
+    int caps_size, compress_cap = vdagentd_compress_capability();
+
+    switch (message_header->type) {
+    case VD_AGENT_ANNOUNCE_CAPABILITIES:
+        if (message_header->size < sizeof(VDAgentAnnounceCapabilities))
+            break;
+        caps_size = VD_AGENT_CAPS_SIZE_FROM_MSG_SIZE(message_header->size);
+        virtio_read_selection = VD_AGENT_HAS_CAPABILITY(caps->caps, caps_size,
+                                    VD_AGENT_CAP_CLIPBOARD_SELECTION);
+        virtio_read_compressed = compress_cap != -1 &&
+            VD_AGENT_HAS_CAPABILITY(caps->caps, caps_size, compress_cap);
+        break;
+    case VD_AGENT_MAX_CLIPBOARD:
+        if (message_header->size == sizeof(VDAgentMaxClipboard))
+            virtio_read_max_clipboard = ((VDAgentMaxClipboard *)data)->max;
+        break;
+    case VD_AGENT_CLIENT_DISCONNECTED:
+        virtio_read_selection = 0;
+        virtio_read_compressed = 0;
+        virtio_read_max_clipboard = -1;
+        break;
+    }
+}
+
+/* Called by the reader of the virtio port for every message header read,
+   have the data of compressed clipboard messages decompressed as it comes
+   in */
+static struct vdagentd_decompress *virtio_port_decompress(
+        struct vdagent_virtio_port *vport,
+        int port_nr,
+        VDAgentMessage *message_header)
+{
+    if (port_nr != VDP_CLIENT_PORT || !virtio_read_compressed ||
+            message_header->protocol != VD_AGENT_PROTOCOL ||
+            message_header->type != VD_AGENT_CLIPBOARD)
+        return NULL;
+
+    return vdagentd_decompress_create(virtio_read_selection ? 4 : 0,
+                                      message_header->size,
+                                      virtio_read_max_clipboard);
+}
+
+/* Called on the input thread for every message read from the virtio port,
+   returns 1 for messages which must be passed on to the main loop */
+static int virtio_port_filter_input(
+        struct vdagent_virtio_port *vport,
+        int port_nr,
+        VDAgentMessage *message_header,
+        uint8_t *data,
+        uint64_t message_start)
+{
+    int lost;
+
+    if (message_header->protocol != VD_AGENT_PROTOCOL)
+        return 1;
+
+    virtio_port_track_read(message_header, data);
+
+    switch (message_header->type) {
+    case VD_AGENT_MOUSE_STATE:
+        if (message_header->size != sizeof(VDAgentMouseState))
+            return 1;
+        pthread_mutex_lock(&uinput_lock);
+        do_client_mouse((VDAgentMouseState *)data, message_start);
+        lost = !uinput;
+        pthread_mutex_unlock(&uinput_lock);
+        /* Have the main loop re-open the tablet */
+        return lost;
+    case VD_AGENT_CLIENT_DISCONNECTED:
+        /* Only the reader of the port may do this */
+        vdagent_virtio_port_reset(vport, VDP_CLIENT_PORT);
+        return 1;
+    default:
+        return 1;
+    }
 }
 
 int virtio_port_read_complete(
@@ -242,11 +608,20 @@ int virtio_port_read_complete(
         return 0;
     }
 
+    /* The input thread has done this already */
+    if (!input_thread)
+        virtio_port_track_read(message_header, data);
+
     switch (message_header->type) {
     case VD_AGENT_MOUSE_STATE:
         if (message_header->size != sizeof(VDAgentMouseState))
             goto size_error;
-        vdagentd_uinput_do_mouse(&uinput, (VDAgentMouseState *)data);
+        pthread_mutex_lock(&uinput_lock);
+        /* The input thread only passes mouse states on after handling them
+           when the tablet needs re-opening */
+        if (!input_thread)
+            do_client_mouse((VDAgentMouseState *)data,
+                            virtio_message_start_us(vport, port_nr));
         if (!uinput) {
             /* Try to re-open the tablet */
             struct agent_data *agent_data =
@@ -265,6 +640,7 @@ int virtio_port_read_complete(
                 quit = 1;
             }
         }
+        pthread_mutex_unlock(&uinput_lock);
         break;
     case VD_AGENT_MONITORS_CONFIG:
         if (message_header->size < sizeof(VDAgentMonitorsConfig))
@@ -287,8 +663,8 @@ int virtio_port_read_complete(
             min_size = sizeof(VDAgentClipboardGrab); break;
         case VD_AGENT_CLIPBOARD_REQUEST:
             min_size = sizeof(VDAgentClipboardRequest); break;
-        case VD_AGENT_CLIPBOARD:
-            min_size = sizeof(VDAgentClipboard); break;
+        /* VD_AGENT_CLIPBOARD data may be empty, that is an empty answer,
+           which also is what data failing to decompress turns into */
         }
         if (VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
                                     VD_AGENT_CAP_CLIPBOARD_SELECTION)) {
@@ -300,7 +676,9 @@ int virtio_port_read_complete(
         do_client_clipboard(vport, message_header, data);
         break;
     case VD_AGENT_CLIENT_DISCONNECTED:
-        vdagent_virtio_port_reset(vport, VDP_CLIENT_PORT);
+        /* The input thread has done this already */
+        if (!input_thread)
+            vdagent_virtio_port_reset(vport, VDP_CLIENT_PORT);
         do_client_disconnect();
         break;
     case VD_AGENT_MAX_CLIPBOARD:
@@ -309,6 +687,9 @@ int virtio_port_read_complete(
         VDAgentMaxClipboard *msg = (VDAgentMaxClipboard *)data;
         syslog(LOG_DEBUG, "Set max clipboard: %d", msg->max);
         max_clipboard = msg->max;
+        if (active_session_conn)
+            udscs_write(active_session_conn, VDAGENTD_MAX_CLIPBOARD,
+                        max_clipboard, 0, NULL, 0);
         break;
     default:
         syslog(LOG_WARNING, "unknown message type %d, ignoring",
@@ -326,15 +707,36 @@ size_error:
 static void virtio_write_clipboard(uint8_t selection, uint32_t msg_type,
     const uint8_t *data, uint32_t data_size)
 {
-    uint32_t size = data_size;
+    virtio_write_clipboard_prefixed(selection, msg_type, NULL, 0,
+                                    data, data_size);
+}
+
+/* Write a clipboard message whose data consists of prefix followed by data,
+   without first gathering the two in one buffer */
+static void virtio_write_clipboard_prefixed(uint8_t selection,
+    uint32_t msg_type, const uint8_t *prefix, uint32_t prefix_size,
+    const uint8_t *data, uint32_t data_size)
+{
+    int compress_cap = vdagentd_compress_capability();
+    int compress = msg_type == VD_AGENT_CLIPBOARD && compress_cap != -1 &&
+                   VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
+                                           compress_cap);
+    uint32_t size;
 
+    if (compress)
+        size = vdagentd_compress_bound(prefix_size, data_size);
+    else
+        size = prefix_size + data_size;
     if (VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
                                 VD_AGENT_CAP_CLIPBOARD_SELECTION)) {
         size += 4;
     }
 
-    vdagent_virtio_port_write_start(virtio_port, VDP_CLIENT_PORT, msg_type,
-                                    0, size);
+    if (vdagent_virtio_port_write_start(virtio_port, VDP_CLIENT_PORT,
+                                        msg_type, 0, size)) {
+        syslog(LOG_ERR, "out of memory queueing clipboard message");
+        return;
+    }
 
     if (VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
                                 VD_AGENT_CAP_CLIPBOARD_SELECTION)) {
@@ -342,7 +744,32 @@ static void virtio_write_clipboard(uint8_t selection, uint32_t msg_type,
         vdagent_virtio_port_write_append(virtio_port, sel, 4);
     }
 
-    vdagent_virtio_port_write_append(virtio_port, data, data_size);
+    /* Compressed data gets written straight into the queued message */
+    if (compress) {
+        vdagentd_compress_write(virtio_port, prefix, prefix_size,
+                                data, data_size);
+    } else {
+        vdagent_virtio_port_write_append(virtio_port, prefix, prefix_size);
+        vdagent_virtio_port_write_append(virtio_port, data, data_size);
+    }
+    vdagent_virtio_port_write_set_selection(virtio_port, selection);
+}
+
+/* Same as agent_drop_superseded_clipboard, but for the client */
+static void virtio_drop_superseded_clipboard(uint8_t selection)
+{
+    int n;
+
+    vdagent_virtio_port_drop_pending(virtio_port, VDP_CLIENT_PORT, selection,
+                                     (1 << VD_AGENT_CLIPBOARD_GRAB) |
+                                     (1 << VD_AGENT_CLIPBOARD_RELEASE));
+    n = vdagent_virtio_port_drop_pending(virtio_port, VDP_CLIENT_PORT,
+                                         selection, 1 << VD_AGENT_CLIPBOARD);
+    if (n && debug)
+        syslog(LOG_DEBUG, "dropped %d superseded clipboard data msg(s) "
+               "for the client", n);
+    while (n--)
+        virtio_write_clipboard(selection, VD_AGENT_CLIPBOARD, NULL, 0);
 }
 
 /* vdagentd <-> vdagent communication handling */
@@ -350,7 +777,13 @@ int do_agent_clipboard(struct udscs_connection *conn,
         struct udscs_message_header *header, const uint8_t *data)
 {
     uint8_t selection = header->arg1;
-    uint32_t msg_type = 0, size = header->size;
+    uint32_t msg_type = 0, size = header->size, type_size = 0, data_size;
+    const uint8_t *cached;
+    uint8_t *by_name = NULL;
+    const char *type = NULL;
+    uint32_t cached_size;
+    int too_large, duplicate;
+    uint32_t id;
 
     if (!VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
                                  VD_AGENT_CAP_CLIPBOARD_BY_DEMAND))
@@ -378,57 +811,169 @@ int do_agent_clipboard(struct udscs_connection *conn,
         goto error;
     }
 
+    /* An empty grab means the contents changed but the types did not,
+       so the client already has what it needs, unless the agent's last
+       grab never reached it or got released on its behalf since */
+    if (header->type == VDAGENTD_CLIPBOARD_GRAB && size == 0) {
+        vdagentd_clipboard_invalidate(clipboard, selection);
+        if (!agent_owns_clipboard[selection])
+            udscs_write(conn, VDAGENTD_CLIPBOARD_REGRAB, selection, 0,
+                        NULL, 0);
+        return 0;
+    }
+
+    switch (header->type) {
+    case VDAGENTD_CLIPBOARD_GRAB:
+        by_name = agent_clipboard_grab_by_name(conn, data, &size);
+        data = by_name;
+        break;
+    case VDAGENTD_CLIPBOARD_REQUEST:
+    case VDAGENTD_CLIPBOARD_DATA:
+        /* The type id followed by the data, the client gets the type name
+           followed by the data, which get written one after the other */
+        type = agent_clipboard_type(conn, data, size);
+        if (header->type == VDAGENTD_CLIPBOARD_REQUEST && !type)
+            goto error;
+        if (type && header->type == VDAGENTD_CLIPBOARD_DATA) {
+            data += sizeof(uint16_t);
+            size -= sizeof(uint16_t);
+        } else {
+            size = 0;
+        }
+        if (type)
+            type_size = strlen(type) + 1;
+        break;
+    }
+
     switch (header->type) {
     case VDAGENTD_CLIPBOARD_GRAB:
         msg_type = VD_AGENT_CLIPBOARD_GRAB;
+        duplicate = vdagentd_clipboard_grab_is_duplicate(clipboard, selection,
+                                                         header->arg2,
+                                                         data, size);
+        /* The contents may have changed even if the types have not */
+        vdagentd_clipboard_invalidate(clipboard, selection);
+        if (duplicate && agent_owns_clipboard[selection])
+            goto out;
         agent_owns_clipboard[selection] = 1;
+        virtio_drop_superseded_clipboard(selection);
         break;
     case VDAGENTD_CLIPBOARD_REQUEST:
         msg_type = VD_AGENT_CLIPBOARD_REQUEST;
+        if (!vdagentd_clipboard_cache_lookup(clipboard,
+                                             VDAGENTD_CLIPBOARD_AGENT,
+                                             selection, type,
+                                             &cached, &cached_size)) {
+            agent_write_clipboard(conn, VDAGENTD_CLIPBOARD_DATA, selection,
+                                  header->arg2, cached, cached_size);
+            goto out;
+        }
+        if (vdagentd_clipboard_request_add(clipboard, VDAGENTD_CLIPBOARD_AGENT,
+                                           selection, type,
+                                           header->arg2,
+                                           vdagent_virtio_port_get_pending_size(
+                                               virtio_port))) {
+            syslog(LOG_ERR, "out of memory allocating clipboard request");
+            goto error;
+        }
         break;
     case VDAGENTD_CLIPBOARD_DATA:
         msg_type = VD_AGENT_CLIPBOARD;
-        if (max_clipboard != -1 && size > max_clipboard) {
+        data_size = type ? VDAGENTD_CLIPBOARD_DATA_SIZE(strlen(type), size) : 0;
+        too_large = max_clipboard != -1 && data_size > max_clipboard;
+        if (vdagentd_clipboard_request_done(clipboard,
+                                            VDAGENTD_CLIPBOARD_CLIENT, selection,
+                                            type, data, too_large ? 0 : size,
+                                            udscs_get_message_start(conn),
+                                            vdagent_virtio_port_get_pending_size(
+                                                virtio_port),
+                                            &id))
+            goto out;
+        if (too_large) {
             syslog(LOG_WARNING, "clipboard is too large (%d > %d), discarding",
-                   size, max_clipboard);
+                   data_size, max_clipboard);
             virtio_write_clipboard(selection, msg_type, NULL, 0);
-            return 0;
+            goto out;
         }
         break;
     case VDAGENTD_CLIPBOARD_RELEASE:
         msg_type = VD_AGENT_CLIPBOARD_RELEASE;
         agent_owns_clipboard[selection] = 0;
+        vdagentd_clipboard_invalidate(clipboard, selection);
+        vdagentd_clipboard_forget_grab(clipboard, selection);
+        virtio_drop_superseded_clipboard(selection);
         break;
     default:
         syslog(LOG_WARNING, "unexpected clipboard message type");
         goto error;
     }
 
-    virtio_write_clipboard(selection, msg_type, data, header->size);
+    virtio_write_clipboard_prefixed(selection, msg_type, (const uint8_t *)type,
+                                    type_size, data, size);
 
+out:
+    free(by_name);
     return 0;
 
 error:
     if (header->type == VDAGENTD_CLIPBOARD_REQUEST) {
         /* Let the agent know no answer is coming */
         udscs_write(conn, VDAGENTD_CLIPBOARD_DATA,
-                    selection, VD_AGENT_CLIPBOARD_NONE, NULL, 0);
+                    selection, header->arg2, NULL, 0);
+    }
+    if (header->type == VDAGENTD_CLIPBOARD_GRAB && header->size == 0) {
+        /* Its next grab must carry the types, a full grab which gets
+           rejected is not answered, so this cannot loop */
+        udscs_write(conn, VDAGENTD_CLIPBOARD_REGRAB, selection, 0, NULL, 0);
     }
+    free(by_name);
     return 0;
 }
 
+static void virtio_port_disconnect(struct vdagent_virtio_port *vport)
+{
+    /* The input thread must be gone before the port gets freed */
+    vdagentd_input_thread_destroy(&input_thread);
+}
+
+static struct vdagent_virtio_port *open_virtio_port(void)
+{
+    struct vdagent_virtio_port *vport;
+
+    virtio_read_selection = 0;
+    virtio_read_compressed = 0;
+    virtio_read_max_clipboard = -1;
+
+    vport = vdagent_virtio_port_create(portdev, virtio_port_read_complete,
+                                       virtio_port_disconnect,
+                                       virtio_port_decompress);
+    if (vport && use_input_thread) {
+        input_thread = vdagentd_input_thread_create(vport,
+                                                    virtio_port_filter_input,
+                                                    virtio_port_read_complete,
+                                                    input_thread_priority);
+        if (!input_thread)
+            syslog(LOG_WARNING,
+                   "no input thread, handling mouse events in the main loop");
+    }
+
+    return vport;
+}
+
 /* When we open the vdagent virtio channel, the server automatically goes into
    client mouse mode, so we can only have the channel open when we know the
    active session resolution. This function checks that we have an agent in the
    active session, and that it has told us its resolution. If these conditions
    are met it sets the uinput tablet device's resolution and opens the virtio
    channel (if it is not already open). If these conditions are not met, it
-   closes both. */
+   closes the virtio channel. */
 static void check_xorg_resolution(void)
 {
     struct agent_data *agent_data = udscs_get_user_data(active_session_conn);
+    int lost;
 
     if (agent_data && agent_data->screen_info) {
+        pthread_mutex_lock(&uinput_lock);
         if (!uinput)
             uinput = vdagentd_uinput_create(uinput_device,
                                             agent_data->width,
@@ -443,7 +988,9 @@ static void check_xorg_resolution(void)
                                         agent_data->height,
                                         agent_data->screen_info,
                                         agent_data->screen_count);
-        if (!uinput) {
+        lost = !uinput;
+        pthread_mutex_unlock(&uinput_lock);
+        if (lost) {
             syslog(LOG_CRIT, "Fatal uinput error");
             retval = 1;
             quit = 1;
@@ -452,9 +999,7 @@ static void check_xorg_resolution(void)
 
         if (!virtio_port) {
             syslog(LOG_INFO, "opening vdagent virtio channel");
-            virtio_port = vdagent_virtio_port_create(portdev,
-                                                     virtio_port_read_complete,
-                                                     NULL);
+            virtio_port = open_virtio_port();
             if (!virtio_port) {
                 syslog(LOG_CRIT, "Fatal error opening vdagent virtio channel");
                 retval = 1;
@@ -464,9 +1009,7 @@ static void check_xorg_resolution(void)
             send_capabilities(virtio_port, 1);
         }
     } else {
-#ifndef WITH_STATIC_UINPUT
-        vdagentd_uinput_destroy(&uinput);
-#endif
+        /* the tablet is kept for the next active session */
         if (virtio_port) {
             vdagent_virtio_port_flush(&virtio_port);
             vdagent_virtio_port_destroy(&virtio_port);
@@ -497,10 +1040,11 @@ void release_clipboards(void)
 
     for (sel = 0; sel < VD_AGENT_CLIPBOARD_SELECTION_SECONDARY; ++sel) {
         if (agent_owns_clipboard[sel] && virtio_port) {
-            vdagent_virtio_port_write(virtio_port, VDP_CLIENT_PORT,
-                                      VD_AGENT_CLIPBOARD_RELEASE, 0, &sel, 1);
+            virtio_drop_superseded_clipboard(sel);
+            virtio_write_clipboard(sel, VD_AGENT_CLIPBOARD_RELEASE, NULL, 0);
         }
         agent_owns_clipboard[sel] = 0;
+        vdagentd_clipboard_forget_grab(clipboard, sel);
     }
 }
 
@@ -529,6 +1073,11 @@ void update_active_session_connection(struct udscs_connection *new_conn)
     if (new_conn == active_session_conn)
         return;
 
+    /* Requests from / to the old agent will never be answered */
+    vdagentd_clipboard_request_cancel_all(clipboard, VDAGENTD_CLIPBOARD_AGENT);
+    vdagentd_clipboard_request_cancel_all(clipboard, VDAGENTD_CLIPBOARD_CLIENT);
+    vdagentd_clipboard_invalidate_all(clipboard);
+
     active_session_conn = new_conn;
     if (debug)
         syslog(LOG_DEBUG, "%p is now the active session", new_conn);
@@ -536,6 +1085,9 @@ void update_active_session_connection(struct udscs_connection *new_conn)
         udscs_write(active_session_conn, VDAGENTD_MONITORS_CONFIG, 0, 0,
                     (uint8_t *)mon_config, sizeof(VDAgentMonitorsConfig) +
                     mon_config->num_of_monitors * sizeof(VDAgentMonConfig));
+    if (active_session_conn && max_clipboard != -1)
+        udscs_write(active_session_conn, VDAGENTD_MAX_CLIPBOARD,
+                    max_clipboard, 0, NULL, 0);
 
     release_clipboards();
 
@@ -547,6 +1099,13 @@ void agent_connect(struct udscs_connection *conn)
     struct agent_data *agent_data;
 
     agent_data = calloc(1, sizeof(*agent_data));
+    if (agent_data) {
+        agent_data->types = vdagentd_typedict_create();
+        if (!agent_data->types) {
+            free(agent_data);
+            agent_data = NULL;
+        }
+    }
     if (!agent_data) {
         syslog(LOG_ERR, "Out of memory allocating agent data, disconnecting");
         udscs_destroy_connection(&conn);
@@ -572,6 +1131,7 @@ void agent_disconnect(struct udscs_connection *conn)
     agent_data->session = NULL;
     update_active_session_connection(NULL);
 
+    vdagentd_typedict_destroy(&agent_data->types);
     free(agent_data);
 }
 
@@ -628,6 +1188,17 @@ void agent_read_complete(struct udscs_connection **connp,
             return;
         }
         break;
+    case VDAGENTD_CLIPBOARD_TYPE:
+        if (header->arg1 > UINT16_MAX ||
+                vdagentd_typedict_add_type(agent_data->types, header->arg1,
+                                           data, header->size)) {
+            syslog(LOG_ERR, "invalid clipboard type message, "
+                            "disconnecting agent");
+            udscs_destroy_connection(connp);
+            free(data);
+            return;
+        }
+        break;
     default:
         syslog(LOG_ERR, "unknown message from vdagent: %u, ignoring",
                header->type);
@@ -645,9 +1216,13 @@ static void usage(FILE *fp)
             "Options:\n"
             "  -h             print this text\n"
             "  -d             log debug messages (use twice for extra info)\n"
+            "  -g <ms>        ignore identical clipboard grabs within [%d]\n"
             "  -s <port>      set virtio serial port  [%s]\n"
             "  -S <filename>  set udcs socket [%s]\n"
             "  -u <dev>       set uinput device       [%s]\n"
+            "  -r             record fake uinput events with timings\n"
+            "  -t             handle mouse events on a separate thread\n"
+            "  -T <prio>      same as -t, with SCHED_FIFO priority <prio>\n"
             "  -x             don't daemonize\n"
 #ifdef HAVE_CONSOLE_KIT
             "  -X             Disable console kit integration\n"
@@ -655,7 +1230,23 @@ static void usage(FILE *fp)
 #ifdef HAVE_LIBSYSTEMD_LOGIN
             "  -X         Disable systemd-logind integration\n"
 #endif
-            ,VERSION, portdev, vdagentd_socket, uinput_device);
+            ,VERSION, grab_window, portdev, vdagentd_socket, uinput_device);
+}
+
+/* Parse a command line option value, which must be a number between min
+   and max. Returns 0 on success, -1 on error. */
+static int parse_int_option(const char *arg, long min, long max, int *value)
+{
+    char *end;
+    long l;
+
+    errno = 0;
+    l = strtol(arg, &end, 10);
+    if (errno || end == arg || *end || l < min || l > max)
+        return -1;
+
+    *value = l;
+    return 0;
 }
 
 void daemonize(void)
@@ -687,15 +1278,27 @@ void daemonize(void)
 void main_loop(void)
 {
     fd_set readfds, writefds;
-    int n, nfds;
+    struct timeval tv, *tvp;
+    int n, nfds, timeout;
     int ck_fd = 0;
 
     while (!quit) {
+        if (dump_log) {
+            vdagentd_clipboard_log_dump(clipboard);
+            pthread_mutex_lock(&uinput_lock);
+            vdagentd_latency_dump(mouse_latency);
+            pthread_mutex_unlock(&uinput_lock);
+            dump_log = 0;
+        }
+
         FD_ZERO(&readfds);
         FD_ZERO(&writefds);
 
         nfds = udscs_server_fill_fds(server, &readfds, &writefds);
         n = vdagent_virtio_port_fill_fds(virtio_port, &readfds, &writefds);
+        if (n >= nfds)
+            nfds = n + 1;
+        n = vdagentd_input_thread_fill_fds(input_thread, &readfds);
         if (n >= nfds)
             nfds = n + 1;
 
@@ -706,7 +1309,15 @@ void main_loop(void)
                 nfds = ck_fd + 1;
         }
 
-        n = select(nfds, &readfds, &writefds, NULL, NULL);
+        timeout = vdagentd_timer_get_timeout();
+        if (timeout >= 0) {
+            tv.tv_sec  = timeout / 1000;
+            tv.tv_usec = (timeout % 1000) * 1000;
+            tvp = &tv;
+        } else
+            tvp = NULL;
+
+        n = select(nfds, &readfds, &writefds, NULL, tvp);
         if (n == -1) {
             if (errno == EINTR)
                 continue;
@@ -718,14 +1329,15 @@ void main_loop(void)
         udscs_server_handle_fds(server, &readfds, &writefds);
 
         if (virtio_port) {
+            if (vdagentd_input_thread_handle_fds(input_thread,
+                                                 &readfds) == -1)
+                vdagent_virtio_port_destroy(&virtio_port);
             vdagent_virtio_port_handle_fds(&virtio_port, &readfds, &writefds);
             if (!virtio_port) {
                 int old_client_connected = client_connected;
                 syslog(LOG_CRIT,
                        "AIIEEE lost spice client connection, reconnecting");
-                virtio_port = vdagent_virtio_port_create(portdev,
-                                                     virtio_port_read_complete,
-                                                     NULL);
+                virtio_port = open_virtio_port();
                 if (!virtio_port) {
                     syslog(LOG_CRIT,
                            "Fatal error opening vdagent virtio channel");
@@ -741,6 +1353,8 @@ void main_loop(void)
             active_session = session_info_get_active_session(session_info);
             update_active_session_connection(NULL);
         }
+
+        vdagentd_timer_dispatch();
     }
 }
 
@@ -749,6 +1363,11 @@ static void quit_handler(int sig)
     quit = 1;
 }
 
+static void dump_log_handler(int sig)
+{
+    dump_log = 1;
+}
+
 int main(int argc, char *argv[])
 {
     int c;
@@ -757,12 +1376,20 @@ int main(int argc, char *argv[])
     struct sigaction act;
 
     for (;;) {
-        if (-1 == (c = getopt(argc, argv, "-dhxXs:u:S:")))
+        if (-1 == (c = getopt(argc, argv, "-dhrtxXg:s:u:S:T:")))
             break;
         switch (c) {
         case 'd':
             debug++;
             break;
+        case 'g':
+            if (parse_int_option(optarg, 0, INT_MAX, &grab_window)) {
+                fprintf(stderr, "invalid clipboard grab window: %s\n\n",
+                        optarg);
+                usage(stderr);
+                return 1;
+            }
+            break;
         case 's':
             portdev = optarg;
             break;
@@ -772,6 +1399,23 @@ int main(int argc, char *argv[])
         case 'u':
             uinput_device = optarg;
             break;
+        case 'r':
+            uinput_record = 1;
+            break;
+        case 't':
+            use_input_thread = 1;
+            break;
+        case 'T':
+            use_input_thread = 1;
+            if (parse_int_option(optarg, sched_get_priority_min(SCHED_FIFO),
+                                 sched_get_priority_max(SCHED_FIFO),
+                                 &input_thread_priority)) {
+                fprintf(stderr, "invalid input thread priority: %s\n\n",
+                        optarg);
+                usage(stderr);
+                return 1;
+            }
+            break;
         case 'x':
             do_daemonize = 0;
             break;
@@ -790,7 +1434,11 @@ int main(int argc, char *argv[])
 
     if (strncmp(uinput_device, "/dev", 4) != 0) {
         syslog(LOG_INFO, "using fake uinput");
-        uinput_fake = 1;
+        uinput_fake = uinput_record ? VDAGENTD_UINPUT_RECORD :
+                                      VDAGENTD_UINPUT_FAKE;
+    } else if (uinput_record) {
+        fprintf(stderr, "recording needs a fake uinput device (-u <file>)\n");
+        return 1;
     }
 
     memset(&act, 0, sizeof(act));
@@ -800,6 +1448,8 @@ int main(int argc, char *argv[])
     sigaction(SIGHUP, &act, NULL);
     sigaction(SIGTERM, &act, NULL);
     sigaction(SIGQUIT, &act, NULL);
+    act.sa_handler = dump_log_handler;
+    sigaction(SIGUSR1, &act, NULL);
 
     openlog("spice-vdagentd", do_daemonize ? 0 : LOG_PERROR, LOG_USER);
 
@@ -823,14 +1473,32 @@ int main(int argc, char *argv[])
     if (do_daemonize)
         daemonize();
 
-#ifdef WITH_STATIC_UINPUT
-    uinput = vdagentd_uinput_create(uinput_device, 1024, 768, NULL, 0,
-                                    debug > 1, uinput_fake);
-    if (!uinput) {
+    /* Create the tablet right away, X servers without input hotplug support
+       only pick it up if it exists when they start. Its range is fixed, so
+       it only needs its size set once the active session reports it. The
+       fake device is created later, opening the Xspice fifo blocks until
+       Xspice opens it too. */
+    if (!uinput_fake) {
+        uinput = vdagentd_uinput_create(uinput_device, 0, 0, NULL, 0,
+                                        debug > 1, uinput_fake);
+        if (!uinput) {
+            syslog(LOG_CRIT, "Fatal uinput error");
+            udscs_destroy_server(server);
+            return 1;
+        }
+    }
+
+    clipboard = vdagentd_clipboard_create(clipboard_request_expired,
+                                          grab_window, debug);
+    if (!clipboard) {
+        syslog(LOG_CRIT, "Fatal out of memory allocating clipboard data");
+        vdagentd_uinput_destroy(&uinput);
         udscs_destroy_server(server);
         return 1;
     }
-#endif
+
+    /* no statistics if this fails */
+    mouse_latency = vdagentd_latency_create();
 
     if (want_session_info)
         session_info = session_info_create(debug);
@@ -841,11 +1509,13 @@ int main(int argc, char *argv[])
 
     release_clipboards();
 
-    vdagentd_uinput_destroy(&uinput);
     vdagent_virtio_port_flush(&virtio_port);
     vdagent_virtio_port_destroy(&virtio_port);
+    vdagentd_uinput_destroy(&uinput);
     session_info_destroy(session_info);
     udscs_destroy_server(server);
+    vdagentd_clipboard_destroy(&clipboard);
+    vdagentd_latency_destroy(&mouse_latency);
     if (unlink(vdagentd_socket) != 0)
         syslog(LOG_ERR, "unlink %s: %s", vdagentd_socket, strerror(errno));
     syslog(LOG_INFO, "vdagentd quiting, returning status %d", retval);
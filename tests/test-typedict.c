@@ -0,0 +1,126 @@
+/*  test-typedict.c test of the clipboard type dictionary limits
+
+    Copyright 2026 The spice-vdagent contributors
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* This sends a client picked type name after another, like a client which
+   grabs with a new type every time, and checks that ids keep being handed
+   out, starting over once the dictionary is full. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vdagentd/vdagentd-typedict.h"
+
+#define fail(...) do { \
+    fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+    fprintf(stderr, __VA_ARGS__); \
+    fprintf(stderr, "\n"); \
+    exit(1); \
+} while (0)
+
+/* Reserve room for and get the id of a single type, like a request does */
+static uint16_t get_id(struct vdagentd_typedict *dict, const char *type,
+                       int *is_new)
+{
+    vdagentd_typedict_reserve(dict, (const uint8_t *)type, strlen(type) + 1);
+    return vdagentd_typedict_get_id(dict, type, is_new);
+}
+
+int main(int argc, char *argv[])
+{
+    struct vdagentd_typedict *dict;
+    char type[64], big[1024], grab[3 * 64];
+    uint16_t id, first;
+    uint32_t i, pos;
+    int is_new;
+
+    dict = vdagentd_typedict_create();
+    if (!dict)
+        fail("out of memory");
+
+    /* Known types keep their id */
+    first = get_id(dict, "UTF8_STRING", &is_new);
+    if (first != 1 || !is_new)
+        fail("first id %u, new %d", first, is_new);
+    id = get_id(dict, "UTF8_STRING", &is_new);
+    if (id != first || is_new)
+        fail("known type got id %u, new %d", id, is_new);
+
+    /* Fill up the dictionary, the next type starts over from id 1 */
+    for (i = 1; i < VDAGENTD_TYPEDICT_MAX_TYPES; i++) {
+        snprintf(type, sizeof(type), "application/x-test-%u", i);
+        id = get_id(dict, type, &is_new);
+        if (id != i + 1 || !is_new)
+            fail("type %u got id %u, new %d", i, id, is_new);
+    }
+    id = get_id(dict, "text/plain", &is_new);
+    if (id != 1 || !is_new)
+        fail("type after a full dictionary got id %u, new %d", id, is_new);
+
+    /* and forgot the old types, so they get announced again */
+    id = get_id(dict, "UTF8_STRING", &is_new);
+    if (id != 2 || !is_new)
+        fail("forgotten type got id %u, new %d", id, is_new);
+
+    /* Long names fill it up too, the ids never run out */
+    vdagentd_typedict_destroy(&dict);
+    dict = vdagentd_typedict_create();
+    if (!dict)
+        fail("out of memory");
+    memset(big, 'x', sizeof(big) - 1);
+    big[sizeof(big) - 1] = '\0';
+    for (i = 0; i < 100000; i++) {
+        snprintf(big, sizeof(big), "%u", i);
+        big[strlen(big)] = 'x';
+        id = get_id(dict, big, &is_new);
+        if (!id || !is_new)
+            fail("long type %u got id %u, new %d", i, id, is_new);
+        if (id > VDAGENTD_TYPEDICT_MAX_SIZE / sizeof(big))
+            fail("long type %u got id %u, too many names", i, id);
+    }
+
+    /* A grab which does not fit gets all of its types in one go, not ids
+       from before and after starting over */
+    vdagentd_typedict_destroy(&dict);
+    dict = vdagentd_typedict_create();
+    if (!dict)
+        fail("out of memory");
+    for (i = 0; i < VDAGENTD_TYPEDICT_MAX_TYPES - 2; i++) {
+        snprintf(type, sizeof(type), "application/x-test-%u", i);
+        get_id(dict, type, &is_new);
+    }
+    pos = 0;
+    for (i = 0; i < 3; i++)
+        pos += snprintf(grab + pos, sizeof(grab) - pos, "grab-%u", i) + 1;
+    vdagentd_typedict_reserve(dict, (uint8_t *)grab, pos);
+    for (pos = 0, i = 0; i < 3; i++) {
+        id = vdagentd_typedict_get_id(dict, grab + pos, &is_new);
+        if (id != i + 1 || !is_new)
+            fail("grab type %u got id %u, new %d", i, id, is_new);
+        pos += strlen(grab + pos) + 1;
+    }
+
+    vdagentd_typedict_destroy(&dict);
+    if (dict)
+        fail("dictionary not cleared on destroy");
+
+    return 0;
+}
@@ -0,0 +1,494 @@
+/*  test-virtio-compress.c test of compressed clipboard data over a virtio port
+
+    Copyright 2026 The spice-vdagent contributors
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* This plays the client, on the host side of a virtio port which is a unix
+   domain socket, and checks that clipboard data compressed by the daemon
+   decodes to what was sent, and that data compressed by the client (with an
+   encoder written from the format description) is decompressed as it is
+   read. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <lz4.h>
+#include <spice/vd_agent.h>
+
+#include "vdagentd/vdagent-virtio-port.h"
+#include "vdagentd/vdagentd-compress.h"
+
+#define SELECTION_SIZE 4
+
+static int client_fd = -1;
+static int decompress_messages = 1;
+static int max_size = -1;
+
+/* The message received by the daemon side */
+static int received = 0;
+static uint32_t received_size;
+static uint8_t *received_data;
+
+#define fail(...) do { \
+    fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+    fprintf(stderr, __VA_ARGS__); \
+    fprintf(stderr, "\n"); \
+    exit(1); \
+} while (0)
+
+static void put_le32(uint8_t *buf, uint32_t val)
+{
+    buf[0] = val;
+    buf[1] = val >> 8;
+    buf[2] = val >> 16;
+    buf[3] = val >> 24;
+}
+
+static uint32_t get_le32(const uint8_t *buf)
+{
+    return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+static uint8_t *make_data(uint32_t size, int compressible)
+{
+    uint8_t *data = malloc(size);
+    uint32_t i, seed = 12345;
+
+    for (i = 0; i < size; i++) {
+        seed = seed * 1103515245 + 12345;
+        data[i] = compressible ? "clipboard text "[i % 15] : seed >> 16;
+    }
+    return data;
+}
+
+static void write_all(int fd, const uint8_t *buf, size_t size)
+{
+    ssize_t n;
+
+    while (size) {
+        n = send(fd, buf, size, 0);
+        if (n <= 0)
+            fail("client write: %s", strerror(errno));
+        buf += n;
+        size -= n;
+    }
+}
+
+static void read_all(int fd, uint8_t *buf, size_t size)
+{
+    ssize_t n;
+
+    while (size) {
+        n = recv(fd, buf, size, 0);
+        if (n <= 0)
+            fail("client read: %s", n ? strerror(errno) : "eof");
+        buf += n;
+        size -= n;
+    }
+}
+
+/* Daemon side callbacks */
+static int read_callback(struct vdagent_virtio_port *vport, int port_nr,
+    VDAgentMessage *message_header, uint8_t *data)
+{
+    return 0;
+}
+
+static int message_callback(void *user_data, int port_nr,
+    VDAgentMessage *message_header, uint8_t *data, uint64_t message_start)
+{
+    received = 1;
+    received_size = message_header->size;
+    received_data = malloc(received_size + 1);
+    if (received_size)
+        memcpy(received_data, data, received_size);
+    return 0;
+}
+
+static struct vdagentd_decompress *decompress_callback(
+    struct vdagent_virtio_port *vport, int port_nr,
+    VDAgentMessage *message_header)
+{
+    if (!decompress_messages || message_header->type != VD_AGENT_CLIPBOARD)
+        return NULL;
+
+    return vdagentd_decompress_create(SELECTION_SIZE, message_header->size,
+                                      max_size);
+}
+
+/* Client to daemon: write msg in chunks of at most VD_AGENT_MAX_DATA_SIZE
+   from the client while the daemon side reads them */
+static void client_send(struct vdagent_virtio_port *vport,
+    const uint8_t *data, uint32_t size)
+{
+    VDIChunkHeader chunk_header;
+    VDAgentMessage message_header;
+    uint8_t *msg;
+    uint32_t msg_size = sizeof(message_header) + size, pos = 0, chunk;
+    struct pollfd pfds[2];
+
+    message_header.protocol = VD_AGENT_PROTOCOL;
+    message_header.type = VD_AGENT_CLIPBOARD;
+    message_header.opaque = 0;
+    message_header.size = size;
+    msg = malloc(msg_size);
+    memcpy(msg, &message_header, sizeof(message_header));
+    memcpy(msg + sizeof(message_header), data, size);
+
+    received = 0;
+    pfds[0].fd = vdagent_virtio_port_get_fd(vport);
+    pfds[0].events = POLLIN;
+    pfds[1].fd = client_fd;
+    pfds[1].events = POLLOUT;
+
+    while (!received) {
+        if (poll(pfds, pos < msg_size ? 2 : 1, -1) == -1)
+            fail("poll: %s", strerror(errno));
+        if (pos < msg_size && (pfds[1].revents & POLLOUT)) {
+            chunk = msg_size - pos;
+            if (chunk > VD_AGENT_MAX_DATA_SIZE)
+                chunk = VD_AGENT_MAX_DATA_SIZE;
+            chunk_header.port = VDP_CLIENT_PORT;
+            chunk_header.size = chunk;
+            write_all(client_fd, (uint8_t *)&chunk_header,
+                      sizeof(chunk_header));
+            write_all(client_fd, msg + pos, chunk);
+            pos += chunk;
+        }
+        if (pfds[0].revents & POLLIN) {
+            if (vdagent_virtio_port_read(vport, message_callback, NULL))
+                fail("daemon side read failed");
+        }
+    }
+    if (pos != msg_size)
+        fail("message handled before it was completely sent");
+    free(msg);
+}
+
+/* Daemon to client: have the daemon side write the message while the client
+   reads it, returns the message data */
+static uint8_t *client_receive(struct vdagent_virtio_port **vportp,
+    uint32_t *size)
+{
+    VDIChunkHeader chunk_header;
+    VDAgentMessage message_header;
+    uint8_t *data;
+    fd_set readfds, writefds;
+    pid_t pid;
+    int status;
+
+    /* Write from a child, the daemon side blocks until the client read it */
+    pid = fork();
+    if (pid == -1)
+        fail("fork: %s", strerror(errno));
+    if (pid == 0) {
+        while (*vportp && vdagent_virtio_port_get_pending_size(*vportp)) {
+            FD_ZERO(&readfds);
+            FD_ZERO(&writefds);
+            vdagent_virtio_port_fill_fds(*vportp, &readfds, &writefds);
+            vdagent_virtio_port_handle_fds(vportp, &readfds, &writefds);
+        }
+        _exit(*vportp ? 0 : 1);
+    }
+
+    read_all(client_fd, (uint8_t *)&chunk_header, sizeof(chunk_header));
+    read_all(client_fd, (uint8_t *)&message_header, sizeof(message_header));
+    if (chunk_header.port != VDP_CLIENT_PORT ||
+            chunk_header.size != sizeof(message_header) + message_header.size)
+        fail("bad chunk header");
+    if (message_header.protocol != VD_AGENT_PROTOCOL ||
+            message_header.type != VD_AGENT_CLIPBOARD ||
+            message_header.opaque != 0)
+        fail("bad message header");
+
+    data = malloc(message_header.size + 1);
+    read_all(client_fd, data, message_header.size);
+    *size = message_header.size;
+
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+            WEXITSTATUS(status))
+        fail("daemon side write failed");
+
+    /* The child wrote the queued message, drop the parent's copy */
+    vdagent_virtio_port_drop_pending(*vportp, VDP_CLIENT_PORT, 0,
+                                     1 << VD_AGENT_CLIPBOARD);
+    return data;
+}
+
+/* Encode like a client would, if compressed is 0 use VDAGENTD_COMPRESS_NONE */
+static uint8_t *client_encode(const uint8_t *data, uint32_t size,
+    int compressed, uint32_t *encoded_size)
+{
+    uint8_t *buf = malloc(SELECTION_SIZE + 8 + size + 8 * (size / 65536 + 1) +
+                          LZ4_COMPRESSBOUND(65536));
+    uint32_t pos = 0, block, out;
+    int n;
+
+    memset(buf, 0, SELECTION_SIZE);
+    buf[0] = VD_AGENT_CLIPBOARD_SELECTION_PRIMARY;
+    out = SELECTION_SIZE;
+    put_le32(buf + out, compressed ? VDAGENTD_COMPRESS_LZ4 :
+                                     VDAGENTD_COMPRESS_NONE);
+    put_le32(buf + out + 4, size);
+    out += 8;
+
+    if (!compressed) {
+        memcpy(buf + out, data, size);
+        *encoded_size = out + size;
+        return buf;
+    }
+
+    for (pos = 0; pos < size; pos += block) {
+        block = size - pos > 65536 ? 65536 : size - pos;
+        n = LZ4_compress_default((const char *)data + pos,
+                                 (char *)buf + out + 8, block, block - 1);
+        if (n <= 0) {
+            memcpy(buf + out + 8, data + pos, block);
+            n = block;
+        }
+        put_le32(buf + out, block);
+        put_le32(buf + out + 4, n);
+        out += 8 + n;
+    }
+
+    *encoded_size = out;
+    return buf;
+}
+
+/* Decode like a client would */
+static uint8_t *client_decode(const uint8_t *buf, uint32_t size,
+    uint32_t *decoded_size)
+{
+    uint32_t codec, raw_size, pos = 0, in = 8, block_raw, block_size;
+    uint8_t *data;
+
+    if (size < 8)
+        fail("short data");
+    codec = get_le32(buf);
+    raw_size = get_le32(buf + 4);
+    data = malloc(raw_size + 1);
+
+    if (codec == VDAGENTD_COMPRESS_NONE) {
+        if (size - 8 != raw_size)
+            fail("bad size");
+        memcpy(data, buf + 8, raw_size);
+        *decoded_size = raw_size;
+        return data;
+    }
+    if (codec != VDAGENTD_COMPRESS_LZ4)
+        fail("bad codec %u", codec);
+
+    while (in < size) {
+        block_raw = get_le32(buf + in);
+        block_size = get_le32(buf + in + 4);
+        in += 8;
+        if (block_raw > 65536 || block_raw > raw_size - pos ||
+                block_size > size - in)
+            fail("bad block");
+        if (block_size == block_raw)
+            memcpy(data + pos, buf + in, block_raw);
+        else if (LZ4_decompress_safe((const char *)buf + in,
+                                     (char *)data + pos, block_size,
+                                     block_raw) != (int)block_raw)
+            fail("corrupt block");
+        in += block_size;
+        pos += block_raw;
+    }
+    if (pos != raw_size)
+        fail("truncated");
+
+    *decoded_size = raw_size;
+    return data;
+}
+
+static void test_daemon_to_client(struct vdagent_virtio_port **vportp,
+    uint32_t size, int compressible, uint32_t expected_codec)
+{
+    uint8_t *data = make_data(size, compressible), *msg, *decoded;
+    uint8_t sel[SELECTION_SIZE] = { VD_AGENT_CLIPBOARD_SELECTION_PRIMARY };
+    uint32_t msg_size, decoded_size, bound;
+    /* Write the start of the data as a separate prefix, like a type name */
+    uint32_t prefix_size = size < 11 ? size : 11;
+
+    bound = vdagentd_compress_bound(prefix_size, size - prefix_size);
+    if (vdagent_virtio_port_write_start(*vportp, VDP_CLIENT_PORT,
+                                        VD_AGENT_CLIPBOARD, 0,
+                                        SELECTION_SIZE + bound) ||
+            vdagent_virtio_port_write_append(*vportp, sel, SELECTION_SIZE) ||
+            vdagentd_compress_write(*vportp, data, prefix_size,
+                                    data + prefix_size, size - prefix_size))
+        fail("queueing %u bytes", size);
+    vdagent_virtio_port_write_set_selection(*vportp, 0);
+
+    msg = client_receive(vportp, &msg_size);
+    if (msg_size < SELECTION_SIZE || memcmp(msg, sel, SELECTION_SIZE))
+        fail("bad selection");
+
+    if (size == 0) {
+        if (msg_size != SELECTION_SIZE)
+            fail("empty data got a header");
+    } else {
+        if (get_le32(msg + SELECTION_SIZE) != expected_codec)
+            fail("%u bytes: codec %u instead of %u", size,
+                 get_le32(msg + SELECTION_SIZE), expected_codec);
+        if (msg_size > SELECTION_SIZE + bound)
+            fail("%u bytes: encoded to %u bytes", size, msg_size);
+        if (compressible && size >= VDAGENTD_COMPRESS_MIN_SIZE &&
+                msg_size >= size / 4)
+            fail("%u bytes: only compressed to %u bytes", size, msg_size);
+        decoded = client_decode(msg + SELECTION_SIZE,
+                                msg_size - SELECTION_SIZE, &decoded_size);
+        if (decoded_size != size || memcmp(decoded, data, size))
+            fail("%u bytes: decoded data differs", size);
+        free(decoded);
+    }
+
+    free(msg);
+    free(data);
+}
+
+static void check_received(const uint8_t *data, uint32_t size)
+{
+    if (received_size != SELECTION_SIZE + size ||
+            received_data[0] != VD_AGENT_CLIPBOARD_SELECTION_PRIMARY ||
+            (size && memcmp(received_data + SELECTION_SIZE, data, size)))
+        fail("received %u bytes instead of %u", received_size,
+             SELECTION_SIZE + size);
+    free(received_data);
+}
+
+static void test_client_to_daemon(struct vdagent_virtio_port *vport,
+    uint32_t size, int compressible, int compressed)
+{
+    uint8_t *data = make_data(size, compressible), *msg;
+    uint32_t msg_size;
+
+    msg = client_encode(data, size, compressed, &msg_size);
+    client_send(vport, msg, msg_size);
+    check_received(data, size);
+
+    free(msg);
+    free(data);
+}
+
+int main(int argc, char *argv[])
+{
+    struct vdagent_virtio_port *vport;
+    struct sockaddr_un address;
+    char path[] = "/tmp/test-virtio-compress-XXXXXX";
+    uint8_t *data, *msg;
+    uint32_t msg_size;
+    uint32_t caps[VDAGENTD_CAPS_SIZE] = { 0 };
+    int listen_fd, cap = vdagentd_compress_capability();
+
+    /* The client announces compression support with this bit */
+    if (cap < 0 || cap >= VDAGENTD_CAPS_SIZE * 32)
+        fail("no usable compression capability: %d", cap);
+    VD_AGENT_SET_CAPABILITY(caps, cap);
+    if (!VD_AGENT_HAS_CAPABILITY(caps, VDAGENTD_CAPS_SIZE, cap))
+        fail("compression capability does not fit the capabilities");
+
+    if (!mkdtemp(path))
+        fail("mkdtemp: %s", strerror(errno));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s/port", path);
+
+    listen_fd = socket(PF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd == -1 ||
+            bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) ||
+            listen(listen_fd, 1))
+        fail("listen: %s", strerror(errno));
+
+    vport = vdagent_virtio_port_create(address.sun_path, read_callback, NULL,
+                                       decompress_callback);
+    if (!vport)
+        fail("creating port");
+    vdagent_virtio_port_set_external_read(vport, 1);
+    client_fd = accept(listen_fd, NULL, NULL);
+    if (client_fd == -1)
+        fail("accept: %s", strerror(errno));
+    unlink(address.sun_path);
+    rmdir(path);
+
+    /* Daemon to client */
+    test_daemon_to_client(&vport, 0, 1, 0);
+    test_daemon_to_client(&vport, 100, 1, VDAGENTD_COMPRESS_NONE);
+    test_daemon_to_client(&vport, VDAGENTD_COMPRESS_MIN_SIZE, 1,
+                          VDAGENTD_COMPRESS_LZ4);
+    test_daemon_to_client(&vport, 1000000, 1, VDAGENTD_COMPRESS_LZ4);
+    test_daemon_to_client(&vport, 200000, 0, VDAGENTD_COMPRESS_LZ4);
+
+    /* Client to daemon */
+    test_client_to_daemon(vport, 100, 1, 0);
+    test_client_to_daemon(vport, 1000000, 1, 1);
+    test_client_to_daemon(vport, 200000, 0, 1);
+    test_client_to_daemon(vport, 65536, 1, 1);
+
+    /* Empty data has no header */
+    data = make_data(SELECTION_SIZE, 1);
+    data[0] = VD_AGENT_CLIPBOARD_SELECTION_PRIMARY;
+    client_send(vport, data, SELECTION_SIZE);
+    check_received(NULL, 0);
+    free(data);
+
+    /* Corrupt or too large data turns into an empty answer */
+    data = make_data(300000, 1);
+    msg = client_encode(data, 300000, 1, &msg_size);
+    /* A token claiming more literals than there is input */
+    memset(msg + SELECTION_SIZE + 16, 0xff,
+           get_le32(msg + SELECTION_SIZE + 12));
+    client_send(vport, msg, msg_size);
+    check_received(NULL, 0);
+    free(msg);
+
+    msg = client_encode(data, 300000, 1, &msg_size);
+    max_size = 299999;
+    client_send(vport, msg, msg_size);
+    check_received(NULL, 0);
+    max_size = -1;
+
+    put_le32(msg + SELECTION_SIZE + 4, 300001);
+    client_send(vport, msg, msg_size);
+    check_received(NULL, 0);
+
+    client_send(vport, msg, msg_size - 1);
+    check_received(NULL, 0);
+    free(msg);
+
+    /* Without compression data is passed on as is */
+    decompress_messages = 0;
+    client_send(vport, data, 300000);
+    if (received_size != 300000 || memcmp(received_data, data, 300000))
+        fail("uncompressed data differs");
+    free(received_data);
+    free(data);
+
+    vdagent_virtio_port_destroy(&vport);
+    close(client_fd);
+    close(listen_fd);
+
+    return 0;
+}